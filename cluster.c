@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "loadgen.h"
+
+#define CLUSTER_SYNC_ROUNDS 8
+#define CLUSTER_LINE_MAX    1024
+
+/* Controller and agents talk in lines of text:
+ *
+ *   agent                          controller
+ *   hello <host> <cpus>      ->
+ *   time <t0>                ->
+ *                            <-    time <t0> <t1> <t2>     (repeated)
+ *   offset <ns> <rtt>        ->
+ *                            <-    load user|sys <cpu> <load_msec>
+ *                            <-    start <ns>
+ *   report <line>            ->                            (every second)
+ *   usage <user> <sys>       ->
+ *                            <-    stop
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds of the sender; the start time
+ * is in controller time and agents translate it with their offset.
+ * All engines start then, but only the user load workers keep their
+ * periods aligned to it; the module paces its threads on its own.
+ */
+
+/* A connection and the part of the input not yet split into lines */
+struct conn {
+    int fd;
+    size_t len;
+    char buf[4 * CLUSTER_LINE_MAX];
+};
+
+struct agent {
+    struct conn conn;
+    int id;                    /* order of joining, from 1 */
+    char host[64];
+    char name[80];             /* host-id: hosts may run several agents */
+    int cpus;
+    int synced;
+    long offset_ns;            /* controller clock minus agent clock */
+    unsigned long rtt_ns;
+    int reported;              /* usage received since the last summary */
+    double user;
+    double sys;
+};
+
+/* Agent side */
+static struct conn ctl;
+
+/* Take the next complete line out of the buffer, if there is one */
+static char *conn_line(struct conn *c, char *line, size_t size)
+{
+    char *nl = memchr(c->buf, '\n', c->len);
+    size_t n;
+
+    if (!nl)
+        return NULL;
+    n = nl - c->buf;
+    if (n >= size)
+        n = size - 1;
+    memcpy(line, c->buf, n);
+    line[n] = '\0';
+    c->len -= nl + 1 - c->buf;
+    memmove(c->buf, nl + 1, c->len);
+
+    return line;
+}
+
+/* Read what has arrived; returns <= 0 on EOF, errors and overlong lines */
+static int conn_fill(struct conn *c)
+{
+    ssize_t n;
+
+    if (c->len == sizeof(c->buf))
+        return -1;
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+    if (n > 0)
+        c->len += n;
+    return n;
+}
+
+static char *conn_getline(struct conn *c, char *line, size_t size)
+{
+    while (!conn_line(c, line, size))
+        if (conn_fill(c) <= 0)
+            return NULL;
+    return line;
+}
+
+static void send_cpu_load(int fd, const char *type, const struct cpu_load *load)
+{
+    dprintf(fd, "load %s %u %u\n", type, load->cpu_num, load->load_msec);
+}
+
+/* Send an agent its plan: a user and a system load descriptor for each
+ * of its CPUs, and the start time.
+ */
+static void controller_send_plan(struct agent *a,
+                                 const struct sys_load *sys_load,
+                                 unsigned long start_ns)
+{
+    struct cpu_load user, sys;
+    int i;
+
+    for (i = 0; i < a->cpus; i++) {
+        user.cpu_num = sys.cpu_num = i;
+        user.load_msec = PCT_TO_MSEC(sys_load->ut);
+        sys.load_msec = PCT_TO_MSEC(sys_load->st);
+        send_cpu_load(a->conn.fd, "user", &user);
+        send_cpu_load(a->conn.fd, "sys", &sys);
+    }
+    dprintf(a->conn.fd, "start %lu\n", start_ns);
+}
+
+static void controller_line(struct agent *a, char *line)
+{
+    unsigned long t0, t1;
+
+    t1 = now_ns();
+    if (sscanf(line, "time %lu", &t0) == 1)
+        dprintf(a->conn.fd, "time %lu %lu %lu\n", t0, t1, now_ns());
+    else if (sscanf(line, "hello %63s %d", a->host, &a->cpus) == 2) {
+        snprintf(a->name, sizeof(a->name), "%s-%d", a->host, a->id);
+        printf("controller: agent %s registered, %d CPUs\n", a->name,
+               a->cpus);
+    }
+    else if (sscanf(line, "offset %ld %lu", &a->offset_ns, &a->rtt_ns) == 2) {
+        a->synced = 1;
+        printf("controller: agent %s clock offset %+.1f us, rtt %.1f us\n",
+               a->name, a->offset_ns / 1e3, a->rtt_ns / 1e3);
+    }
+    else if (strncmp(line, "report ", 7) == 0)
+        printf("%s: %s\n", a->name, line + 7);
+    else if (sscanf(line, "usage %lf %lf", &a->user, &a->sys) == 2)
+        a->reported = 1;
+    else
+        fprintf(stderr, "%s: unexpected message from agent %s: %s\n",
+                progname, a->name, line);
+}
+
+/* Achieved load averaged over the agents that reported last second */
+static void controller_summary(struct agent *agents, int n,
+                               const struct sys_load *sys_load)
+{
+    double user = 0, sys = 0, umin = 100, umax = 0;
+    int i, cnt = 0, live = 0;
+
+    for (i = 0; i < n; i++) {
+        if (agents[i].conn.fd < 0)
+            continue;
+        live++;
+        if (!agents[i].reported)
+            continue;
+        user += agents[i].user;
+        sys += agents[i].sys;
+        if (agents[i].user < umin)
+            umin = agents[i].user;
+        if (agents[i].user > umax)
+            umax = agents[i].user;
+        agents[i].reported = 0;
+        cnt++;
+    }
+    if (!cnt)
+        return;
+
+    printf("cluster: %d/%d agents user %.1f%% (%d) [%.1f-%.1f] "
+           "sys %.1f%% (%d)\n", cnt, live, user / cnt, sys_load->ut, umin,
+           umax, sys / cnt, sys_load->st);
+}
+
+static int controller_listen(unsigned int port)
+{
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6 };
+    int fd, one = 1, zero = 0;
+
+    fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        err_exit("socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_any;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err_exit("bind");
+    if (listen(fd, 64) < 0)
+        err_exit("listen");
+
+    return fd;
+}
+
+/* Wait for nagents agents, give them the plan with a start time
+ * delay_ms after the last one has synchronised its clock, then relay
+ * their reports until stopped or all agents are gone. An agent lost
+ * before the start frees its place for another one. Returns -ETIMEDOUT
+ * if the agents are not all ready within timeout_s, unless it is 0.
+ */
+int controller_run(unsigned int port, int nagents, unsigned int delay_ms,
+                   unsigned int timeout_s, const struct sys_load *sys_load,
+                   volatile sig_atomic_t *stop)
+{
+    struct agent *agents;
+    struct pollfd *fds;
+    char line[CLUSTER_LINE_MAX];
+    unsigned long start_ns = 0, next_ns = 0, join_end_ns = 0, t;
+    int i, n, nfds, fd, timeout, synced, live, ret = 0, joined = 0, ids = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    agents = calloc(nagents, sizeof(struct agent));
+    fds = calloc(nagents + 1, sizeof(struct pollfd));
+    if (!agents || !fds)
+        err_exit("calloc");
+    for (i = 0; i < nagents; i++)
+        agents[i].conn.fd = -1;
+
+    fds[0].fd = controller_listen(port);
+    fds[0].events = POLLIN;
+    printf("controller: waiting for %d agents on port %u\n", nagents, port);
+    fflush(stdout);
+    if (timeout_s)
+        join_end_ns = now_ns() + timeout_s * NSEC_PER_SEC;
+
+    while (!*stop) {
+        nfds = 1;
+        for (i = 0; i < nagents; i++) {
+            fds[nfds].fd = agents[i].conn.fd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        timeout = -1;
+        t = now_ns();
+        if (start_ns)
+            timeout = t < next_ns ? (next_ns - t) / 1000000 + 1 : 0;
+        else if (join_end_ns)
+            timeout = t < join_end_ns ? (join_end_ns - t) / 1000000 + 1 : 0;
+        n = poll(fds, nfds, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err_exit("poll");
+        }
+
+        if (fds[0].revents & POLLIN) {
+            fd = accept4(fds[0].fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0 && (joined == nagents || start_ns))
+                close(fd);
+            else if (fd >= 0) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                           sizeof(int));
+                for (i = 0; agents[i].conn.fd >= 0; i++)
+                    ;
+                agents[i].conn.fd = fd;
+                agents[i].id = ++ids;
+                snprintf(agents[i].name, sizeof(agents[i].name), "agent%d",
+                         agents[i].id);
+                joined++;
+            }
+        }
+
+        for (i = 0; i < nagents; i++) {
+            if (!fds[i + 1].revents || agents[i].conn.fd < 0)
+                continue;
+            if (conn_fill(&agents[i].conn) <= 0) {
+                printf("controller: agent %s is gone\n", agents[i].name);
+                close(agents[i].conn.fd);
+                agents[i].conn.fd = -1;
+                /* Not started yet: another agent can take its place */
+                if (!start_ns) {
+                    memset(&agents[i], 0, sizeof(struct agent));
+                    agents[i].conn.fd = -1;
+                    joined--;
+                }
+                continue;
+            }
+            while (conn_line(&agents[i].conn, line, sizeof(line)))
+                controller_line(&agents[i], line);
+        }
+
+        synced = live = 0;
+        for (i = 0; i < nagents; i++) {
+            if (agents[i].conn.fd < 0)
+                continue;
+            live++;
+            synced += agents[i].synced;
+        }
+
+        if (!start_ns && synced == nagents) {
+            start_ns = now_ns() + MSEC_TO_NSEC(delay_ms);
+            for (i = 0; i < nagents; i++)
+                controller_send_plan(&agents[i], sys_load, start_ns);
+            printf("controller: all agents start in %u ms\n", delay_ms);
+            /* Summaries fall between the agents' reports */
+            next_ns = start_ns + NSEC_PER_SEC * 1.5;
+        }
+        else if (!start_ns && join_end_ns && now_ns() >= join_end_ns) {
+            fprintf(stderr, "%s: only %d of %d agents ready after %u sec\n",
+                    progname, synced, nagents, timeout_s);
+            ret = -ETIMEDOUT;
+            break;
+        }
+        else if (start_ns && !live)
+            break;
+        else if (start_ns && now_ns() >= next_ns) {
+            controller_summary(agents, nagents, sys_load);
+            next_ns += NSEC_PER_SEC;
+        }
+        fflush(stdout);
+    }
+
+    for (i = 0; i < nagents; i++) {
+        if (agents[i].conn.fd < 0)
+            continue;
+        dprintf(agents[i].conn.fd, "stop\n");
+        close(agents[i].conn.fd);
+    }
+    close(fds[0].fd);
+    free(agents);
+    free(fds);
+    return ret;
+}
+
+static int agent_connect(const char *addr)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res, *ai;
+    char host[256];
+    const char *port;
+    int fd = -1, err;
+
+    port = strrchr(addr, ':');
+    if (!port || port == addr || port - addr >= sizeof(host)) {
+        fprintf(stderr, "%s: controller address should be host:port\n",
+                progname);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(host, addr, port - addr);
+    host[port - addr] = '\0';
+    port++;
+
+    /* Allow [v6addr]:port */
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = '\0';
+    }
+
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "%s: %s: %s\n", progname, addr, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        err_exit(addr);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    return fd;
+}
+
+static void agent_lost(void)
+{
+    fprintf(stderr, "%s: lost connection to the controller\n", progname);
+    exit(EXIT_FAILURE);
+}
+
+/* Register with the controller, estimate the clock offset to it and
+ * take the plan into user[] and sys[]. Returns the start time in local
+ * clock.
+ *
+ * The offset is estimated as in NTP: with t0 and t3 the local send and
+ * receive times and t1, t2 the controller's, offset is
+ * ((t1 - t0) + (t2 - t3)) / 2, taken from the round with the lowest
+ * delay, whose error is bounded by half of it.
+ */
+unsigned long agent_init(const char *addr, struct cpu_load *user,
+                         struct cpu_load *sys)
+{
+    char line[CLUSTER_LINE_MAX], host[64], type[8];
+    unsigned long t0, t1, t2, t3, rtt, best_rtt = ULONG_MAX, start;
+    unsigned int cpu, load_msec;
+    long offset = 0;
+    int i;
+
+    signal(SIGPIPE, SIG_IGN);
+    ctl.fd = agent_connect(addr);
+    ctl.len = 0;
+
+    if (gethostname(host, sizeof(host)) < 0)
+        strcpy(host, "unknown");
+    host[sizeof(host) - 1] = '\0';
+    dprintf(ctl.fd, "hello %s %d\n", host, cpus_onln);
+
+    for (i = 0; i < CLUSTER_SYNC_ROUNDS; i++) {
+        t0 = now_ns();
+        dprintf(ctl.fd, "time %lu\n", t0);
+        if (!conn_getline(&ctl, line, sizeof(line)))
+            agent_lost();
+        t3 = now_ns();
+        if (sscanf(line, "time %lu %lu %lu", &t0, &t1, &t2) != 3) {
+            fprintf(stderr, "%s: unexpected reply: %s\n", progname, line);
+            exit(EXIT_FAILURE);
+        }
+        rtt = (t3 - t0) - (t2 - t1);
+        if (rtt < best_rtt) {
+            best_rtt = rtt;
+            offset = ((long) (t1 - t0) + (long) (t2 - t3)) / 2;
+        }
+    }
+    dprintf(ctl.fd, "offset %ld %lu\n", offset, best_rtt);
+    fprintf(stderr, "%s: clock offset to controller %+.1f us, rtt %.1f us\n",
+            progname, offset / 1e3, best_rtt / 1e3);
+
+    while (1) {
+        if (!conn_getline(&ctl, line, sizeof(line)))
+            agent_lost();
+        if (sscanf(line, "load %7s %u %u", type, &cpu, &load_msec) == 3) {
+            if (cpu >= cpus_onln || load_msec > 1000)
+                continue;
+            if (strcmp(type, "user") == 0)
+                user[cpu].load_msec = load_msec;
+            else if (strcmp(type, "sys") == 0)
+                sys[cpu].load_msec = load_msec;
+        }
+        else if (sscanf(line, "start %lu", &start) == 1)
+            break;
+        else if (strcmp(line, "stop") == 0)
+            exit(EXIT_SUCCESS);
+    }
+
+    return start - offset;
+}
+
+/* Wait for the controller until until_ns. Returns 1 on stop. */
+int agent_poll(unsigned long until_ns)
+{
+    struct pollfd pfd = { .fd = ctl.fd, .events = POLLIN };
+    char line[CLUSTER_LINE_MAX];
+    unsigned long t = now_ns();
+    int n;
+
+    n = poll(&pfd, 1, t < until_ns ? (until_ns - t) / 1000000 + 1 : 0);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        err_exit("poll");
+    }
+    if (!n)
+        return 0;
+
+    if (conn_fill(&ctl) <= 0) {
+        fprintf(stderr, "%s: controller is gone\n", progname);
+        return 1;
+    }
+    while (conn_line(&ctl, line, sizeof(line)))
+        if (strcmp(line, "stop") == 0)
+            return 1;
+
+    return 0;
+}
+
+/* Stream the report to the controller with the load our engines
+ * achieved by their own accounting, averaged over our CPUs. /proc/stat
+ * would count every agent on the host and everything else as well.
+ */
+void agent_tick(const char *report, double user, double sys)
+{
+    const char *p, *nl;
+
+    for (p = report; *p; p = nl + 1) {
+        nl = strchrnul(p, '\n');
+        dprintf(ctl.fd, "report %.*s\n", (int) (nl - p), p);
+        if (!*nl)
+            break;
+    }
+    dprintf(ctl.fd, "usage %.2f %.2f\n", user, sys);
+}
+
+void agent_fini(void)
+{
+    close(ctl.fd);
+}
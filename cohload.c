@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "loadgen.h"
+
+#define CACHELINE          64
+#define COH_MAX_WORKERS    64
+#define COH_SAMPLE_MASK    63    /* atomics: time one op out of 64 */
+
+/* Per-worker counters; each on its own line so that reporting does not
+ * add coherence traffic of its own.
+ */
+struct coh_stats {
+    unsigned long ops;
+    struct lat_hist lat;
+} __attribute__((aligned(CACHELINE)));
+
+/* Memory shared by one group of workers */
+struct coh_shared {
+    /* The contended line */
+    struct {
+        volatile unsigned long counter;
+        int lock;
+        int owner;                 /* last lock holder, -1 if none */
+        int waiters;               /* workers waiting for the lock */
+        int contended;             /* someone waited at the last release */
+        unsigned long rel_ns;      /* when the last holder released it */
+    } hot __attribute__((aligned(CACHELINE)));
+
+    /* Private counters packed together for false sharing, eight to a
+     * cache line
+     */
+    unsigned long slots[COH_MAX_WORKERS] __attribute__((aligned(CACHELINE)));
+
+    pthread_mutex_t mutex __attribute__((aligned(CACHELINE)));
+
+    struct coh_stats stats[COH_MAX_WORKERS];
+};
+
+struct coh_group {
+    struct coh_shared *sh;
+    int nworkers;
+    int cpus[COH_MAX_WORKERS];
+    pid_t pids[COH_MAX_WORKERS];
+    struct lat_hist prev[COH_MAX_WORKERS];
+    unsigned long prev_ops[COH_MAX_WORKERS];
+};
+
+struct coh_worker_arg {
+    struct coh_shared *sh;
+    int ind;
+};
+
+static struct coh_load coh;
+static struct coh_group *groups;
+static int ngroups;
+
+static const char *coh_mode_names[] = {
+    [COH_ATOMIC] = "atomic",
+    [COH_FALSE] = "false-sharing",
+    [COH_SPIN] = "spinlock",
+    [COH_MUTEX] = "mutex",
+};
+
+static const char *coh_topo_names[] = {
+    [COH_TOPO_CORE] = "core",
+    [COH_TOPO_LLC] = "llc",
+    [COH_TOPO_CROSS] = "cross-socket",
+};
+
+static inline void spin_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            cpu_relax();
+}
+
+static inline void spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Called with the lock held: account the handoff from the previous
+ * holder if it was another worker and we were already waiting when it
+ * let go. A lock taken after sitting idle is no handoff, with --coh-rate
+ * that would measure the pacing.
+ */
+static inline void coh_handoff(struct coh_shared *sh, int ind)
+{
+    unsigned long t = now_ns();
+
+    if (sh->hot.contended && sh->hot.owner >= 0 && sh->hot.owner != ind)
+        lat_hist_add(&sh->stats[ind].lat, t - sh->hot.rel_ns);
+    sh->hot.counter++;
+    sh->hot.owner = ind;
+    sh->hot.contended = __atomic_load_n(&sh->hot.waiters, __ATOMIC_RELAXED);
+    sh->hot.rel_ns = now_ns();
+}
+
+static inline void coh_op(struct coh_shared *sh, int ind, unsigned long n)
+{
+    unsigned long t;
+
+    switch (coh.mode) {
+    case COH_ATOMIC:
+        if (n & COH_SAMPLE_MASK) {
+            __atomic_fetch_add(&sh->hot.counter, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        t = now_ns();
+        __atomic_fetch_add(&sh->hot.counter, 1, __ATOMIC_SEQ_CST);
+        lat_hist_add(&sh->stats[ind].lat, now_ns() - t);
+        break;
+
+    case COH_FALSE:
+        if (n & COH_SAMPLE_MASK) {
+            __atomic_fetch_add(&sh->slots[ind], 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        t = now_ns();
+        __atomic_fetch_add(&sh->slots[ind], 1, __ATOMIC_SEQ_CST);
+        lat_hist_add(&sh->stats[ind].lat, now_ns() - t);
+        break;
+
+    case COH_SPIN:
+        __atomic_fetch_add(&sh->hot.waiters, 1, __ATOMIC_RELAXED);
+        spin_lock(&sh->hot.lock);
+        __atomic_fetch_sub(&sh->hot.waiters, 1, __ATOMIC_RELAXED);
+        coh_handoff(sh, ind);
+        spin_unlock(&sh->hot.lock);
+        break;
+
+    case COH_MUTEX:
+        __atomic_fetch_add(&sh->hot.waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&sh->mutex);
+        __atomic_fetch_sub(&sh->hot.waiters, 1, __ATOMIC_RELAXED);
+        coh_handoff(sh, ind);
+        pthread_mutex_unlock(&sh->mutex);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void coh_worker_func(void *a)
+{
+    struct coh_worker_arg *arg = a;
+    struct coh_shared *sh = arg->sh;
+    int ind = arg->ind;
+    unsigned long n, t, next, period_ns;
+
+    period_ns = coh.rate ? NSEC_PER_SEC / coh.rate : 0;
+    next = now_ns();
+
+    for (n = 0; ; n++) {
+        coh_op(sh, ind, n);
+        __atomic_store_n(&sh->stats[ind].ops, n + 1, __ATOMIC_RELAXED);
+
+        if (!period_ns)
+            continue;
+
+        /* Pace to the target rate; sleep only when we are ahead by
+         * more than a tick, so that high rates are issued in bursts.
+         */
+        next += period_ns;
+        t = now_ns();
+        if (next > t + 100000)
+            sleep_until_ns(next);
+        else if (t > next + NSEC_PER_SEC)
+            next = t;    /* don't try to catch up a whole second */
+    }
+}
+
+static int read_sysfs_int(const char *fmt, int cpu)
+{
+    char path[128];
+    FILE *f;
+    int val = -1;
+
+    snprintf(path, sizeof(path), fmt, cpu);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &val) != 1)
+        val = -1;
+    fclose(f);
+
+    return val;
+}
+
+/* Last level cache of a CPU, identified by the first CPU sharing it */
+static int llc_key(int cpu)
+{
+    char path[128];
+    int i, level, best = -1, key = cpu, first;
+
+    for (i = 0; ; i++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%%d/cache/index%d/level", i);
+        level = read_sysfs_int(path, cpu);
+        if (level < 0)
+            break;
+        if (level < best)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%%d/cache/"
+                 "index%d/shared_cpu_list", i);
+        first = read_sysfs_int(path, cpu);
+        if (first >= 0) {
+            best = level;
+            key = first;
+        }
+    }
+
+    return key;
+}
+
+static int topo_key(int cpu)
+{
+    int key;
+
+    switch (coh.topo) {
+    case COH_TOPO_CORE:
+        key = read_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/"
+                             "thread_siblings_list", cpu);
+        return key < 0 ? cpu : key;
+    case COH_TOPO_LLC:
+        return llc_key(cpu);
+    case COH_TOPO_CROSS:
+        key = read_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/"
+                             "physical_package_id", cpu);
+        return key < 0 ? 0 : key;
+    }
+
+    return cpu;
+}
+
+/* Fill groups[] with CPU numbers according to the requested topology.
+ * For core and llc a group takes CPUs of one domain; for cross-socket
+ * a group takes one CPU from every socket. Groups never share a CPU:
+ * returns -EINVAL if one doesn't get at least two of its own.
+ */
+static int coh_build_groups(void)
+{
+    int *key, *domain, *used;
+    int ndomains = 0, ret = 0;
+    int cpu, d, g, w, i, want;
+
+    key = calloc(cpus_onln, sizeof(int));
+    domain = calloc(cpus_onln, sizeof(int));
+    used = calloc(cpus_onln, sizeof(int));
+    if (!key || !domain || !used)
+        err_exit("calloc");
+
+    /* domain[] holds distinct keys in order of first appearance */
+    for (cpu = 0; cpu < cpus_onln; cpu++) {
+        key[cpu] = topo_key(cpu);
+        for (d = 0; d < ndomains; d++)
+            if (domain[d] == key[cpu])
+                break;
+        if (d == ndomains)
+            domain[ndomains++] = key[cpu];
+    }
+
+    for (g = 0; g < ngroups; g++) {
+        struct coh_group *grp = &groups[g];
+        int members[COH_MAX_WORKERS];
+        int nmembers = 0;
+
+        if (coh.topo == COH_TOPO_CROSS) {
+            /* The first free CPU of every socket */
+            for (d = 0; d < ndomains && nmembers < COH_MAX_WORKERS; d++)
+                for (cpu = 0; cpu < cpus_onln; cpu++)
+                    if (key[cpu] == domain[d] && !used[cpu]) {
+                        members[nmembers++] = cpu;
+                        break;
+                    }
+        }
+        else {
+            d = g % ndomains;
+            for (cpu = 0; cpu < cpus_onln && nmembers < COH_MAX_WORKERS;
+                 cpu++)
+                if (key[cpu] == domain[d] && !used[cpu])
+                    members[nmembers++] = cpu;
+        }
+
+        want = coh.workers ? coh.workers : nmembers;
+        if (want < 2)
+            want = 2;
+        if (want > nmembers) {
+            fprintf(stderr, "%s: coh group %d needs %d CPUs of its own, "
+                    "only %d are free in its %s domain\n", progname, g,
+                    want, nmembers, coh_topo_names[coh.topo]);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        for (w = 0; w < want; w++) {
+            grp->cpus[w] = members[w];
+            used[members[w]] = 1;
+        }
+        grp->nworkers = want;
+    }
+
+    for (g = 0; g < ngroups; g++) {
+        fprintf(stdout, "coh group %d (%s, %s): cpus", g,
+                coh_mode_names[coh.mode], coh_topo_names[coh.topo]);
+        for (i = 0; i < groups[g].nworkers; i++)
+            fprintf(stdout, " %d", groups[g].cpus[i]);
+        fprintf(stdout, "\n");
+    }
+
+out:
+    free(key);
+    free(domain);
+    free(used);
+    return ret;
+}
+
+static int coh_enabled(const struct sys_load *sys_load)
+{
+    return sys_load->coh.mode != COH_NONE;
+}
+
+static int coh_start(const struct sys_load *sys_load)
+{
+    pthread_mutexattr_t attr;
+    struct coh_worker_arg arg;
+    int g, w, ret;
+
+    coh = sys_load->coh;
+    ngroups = coh.groups > 0 ? coh.groups : 1;
+    groups = calloc(ngroups, sizeof(struct coh_group));
+    if (!groups)
+        err_exit("calloc");
+
+    ret = coh_build_groups();
+    if (ret < 0) {
+        free(groups);
+        groups = NULL;
+        ngroups = 0;
+        return ret;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+
+    for (g = 0; g < ngroups; g++) {
+        groups[g].sh = shared_alloc(sizeof(struct coh_shared));
+        groups[g].sh->hot.owner = -1;
+        pthread_mutex_init(&groups[g].sh->mutex, &attr);
+
+        /* The child gets its own copy of arg at fork() */
+        arg.sh = groups[g].sh;
+        for (w = 0; w < groups[g].nworkers; w++) {
+            arg.ind = w;
+            groups[g].pids[w] = spawn_worker(coh_worker_func, &arg,
+                                             groups[g].cpus[w]);
+        }
+    }
+
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+static void coh_stop(void)
+{
+    int g;
+
+    for (g = 0; g < ngroups; g++) {
+        kill_workers(groups[g].pids, groups[g].nworkers);
+        pthread_mutex_destroy(&groups[g].sh->mutex);
+        shared_free(groups[g].sh, sizeof(struct coh_shared));
+    }
+    free(groups);
+    groups = NULL;
+    ngroups = 0;
+}
+
+static void coh_report(FILE *stream, double interval)
+{
+    struct lat_hist *lat, *snap;
+    unsigned long ops, total;
+    int g, w;
+
+    lat = malloc(sizeof(struct lat_hist));
+    snap = malloc(sizeof(struct lat_hist));
+    if (!lat || !snap)
+        err_exit("malloc");
+
+    for (g = 0; g < ngroups; g++) {
+        struct coh_group *grp = &groups[g];
+
+        memset(lat, 0, sizeof(struct lat_hist));
+        total = 0;
+        for (w = 0; w < grp->nworkers; w++) {
+            ops = __atomic_load_n(&grp->sh->stats[w].ops, __ATOMIC_RELAXED);
+            total += ops - grp->prev_ops[w];
+            grp->prev_ops[w] = ops;
+
+            lat_hist_snap(snap, &grp->sh->stats[w].lat, &grp->prev[w]);
+            lat_hist_merge(lat, snap);
+        }
+
+        fprintf(stream, "coh group %d: %.0f ops/s, %s latency ns: "
+                "avg %lu p50 %lu p99 %lu max %lu\n", g, total / interval,
+                coh.mode >= COH_SPIN ? "handoff" : "op",
+                lat->n ? lat->sum / lat->n : 0, lat_hist_pct(lat, 50),
+                lat_hist_pct(lat, 99), lat->max);
+    }
+
+    free(lat);
+    free(snap);
+}
+
+const struct engine coh_engine = {
+    .name = "coh",
+    .enabled = coh_enabled,
+    .start = coh_start,
+    .stop = coh_stop,
+    .report = coh_report,
+};
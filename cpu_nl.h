@@ -10,6 +10,55 @@ struct cpu_load {
     unsigned int load_msec;
 };
 
+/* Interrupt load for a CPU: a per-CPU hrtimer fires hardirq_hz times a
+ * second and burns hardirq_ns in hard interrupt context; a tasklet is
+ * scheduled softirq_hz times a second and burns softirq_ns in softirq.
+ */
+struct irq_load {
+    unsigned int cpu_num;
+    unsigned int hardirq_hz;
+    unsigned int hardirq_ns;
+    unsigned int softirq_hz;
+    unsigned int softirq_ns;
+};
+
+/* Idle injection for a CPU: the CPU is forced idle for idle_pct percent
+ * of every period_ms window.
+ */
+struct idle_load {
+    unsigned int cpu_num;
+    unsigned int idle_pct;
+    unsigned int period_ms;
+};
+
+/* Sent back by the module in reply to NL_IDLE_STATS */
+struct idle_stats {
+    unsigned int cpu_num;
+    unsigned long long injected_ns;   /* time spent in forced idle */
+    unsigned long long elapsed_ns;    /* time since injection started */
+};
+
+/* Scheduler stress: nr_tasks kthreads for a CPU, each running work_ns
+ * once every period_us; pin keeps them bound to the CPU.
+ */
+struct sched_load {
+    unsigned int cpu_num;
+    unsigned int nr_tasks;
+    unsigned int work_ns;      /* busy time of each task per period */
+    unsigned int period_us;
+    unsigned int pin;
+};
+
+/* Sent back by the module in reply to NL_CPU_STATS */
+struct cpu_stats {
+    unsigned int cpu_num;
+    unsigned long long busy_ns;       /* time the system load kept busy */
+    unsigned long long elapsed_ns;    /* time since its thread started */
+};
+
+/* Message type of replies carrying data, as opposed to acks */
+#define NLMSG_CPUHOG_DATA   (NLMSG_MIN_TYPE + 1)
+
 /* Struct for a packet to be sent via netlink socket. */
 struct nl_packet {
     /* Helps kernel module to determine which action to perform. */
@@ -17,9 +66,21 @@ struct nl_packet {
         NL_INIT,
         NL_CPU_LOAD,
         NL_RUN_THREADS,
-        NL_STOP_THREADS
+        NL_STOP_THREADS,
+        NL_IRQ_LOAD,
+        NL_IDLE_LOAD,
+        NL_IDLE_STATS,
+        NL_SCHED_LOAD,
+        NL_CPU_STATS
     } packet_type;
-    struct cpu_load cpu_load;
+    union {
+        struct cpu_load cpu_load;
+        struct irq_load irq_load;
+        struct idle_load idle_load;
+        struct idle_stats idle_stats;
+        struct sched_load sched_load;
+        struct cpu_stats cpu_stats;
+    };
 };
 
 #endif	/* CPU_NL_H */
@@ -0,0 +1,598 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "loadgen.h"
+
+#define DAEMON_MAX_CLIENTS 16
+#define DAEMON_LINE_MAX    256
+
+/* A connection to the control socket or the metrics port, with its
+ * partial request and the part of the reply the socket did not take.
+ * Sockets are non-blocking, so a slow client only stalls itself.
+ */
+struct client {
+    int fd;
+    int http;                  /* metrics: one request, then close */
+    int closing;               /* close once the reply is out */
+    size_t len;
+    char buf[DAEMON_LINE_MAX];
+    char *out;
+    size_t out_len;
+    size_t out_off;
+};
+
+/* Share of time a CPU spent in each mode over the last interval */
+struct cpu_usage {
+    double user;
+    double system;
+    double irq;
+    double softirq;
+    double idle;
+};
+
+static int ctl_fd = -1;
+static int metrics_fd = -1;
+static const char *ctl_path;
+static struct client clients[DAEMON_MAX_CLIENTS];
+static char *last_report;
+static struct cpu_times *times_prev;
+static struct cpu_usage *usage;
+
+static const char help_text[] =
+    "load <cpu|all> <user|sys> <pct>  set the load target of CPUs\n"
+    "loads                            show the load targets\n"
+    "start <engine>                   start a configured engine\n"
+    "stop <engine>                    stop an engine\n"
+    "engines                          list engines and their state\n"
+    "stats                            show the last report\n"
+    "metrics                          show metrics in OpenMetrics format\n"
+    "shutdown                         stop all engines and exit\n";
+
+static const struct engine *find_engine(const char *name)
+{
+    int i;
+
+    for (i = 0; engines[i]; i++)
+        if (strcmp(engines[i]->name, name) == 0)
+            return engines[i];
+    return NULL;
+}
+
+static void daemon_metrics(FILE *out)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    struct lat_hist *last, *total;
+    int i, j;
+
+    fprintf(out, "# TYPE loadgen_engine_running gauge\n"
+            "# HELP loadgen_engine_running Whether the load engine runs.\n");
+    for (i = 0; engines[i]; i++)
+        fprintf(out, "loadgen_engine_running{engine=\"%s\"} %d\n",
+                engines[i]->name, engine_running(engines[i]));
+
+    fprintf(out, "# TYPE loadgen_cpu_load_target_percent gauge\n"
+            "# HELP loadgen_cpu_load_target_percent Requested CPU load.\n");
+    for (i = 0; i < cpus_onln; i++)
+        fprintf(out, "loadgen_cpu_load_target_percent{cpu=\"%d\",mode=\"user\"} "
+                "%d\nloadgen_cpu_load_target_percent{cpu=\"%d\","
+                "mode=\"system\"} %d\n", i, get_cpu_load(i, 0), i,
+                get_cpu_load(i, 1));
+
+    if (usage) {
+        fprintf(out, "# TYPE loadgen_cpu_load_percent gauge\n"
+                "# HELP loadgen_cpu_load_percent Achieved CPU load over the "
+                "last second.\n");
+        for (i = 0; i < cpus_onln; i++)
+            fprintf(out,
+                    "loadgen_cpu_load_percent{cpu=\"%d\",mode=\"user\"} %.2f\n"
+                    "loadgen_cpu_load_percent{cpu=\"%d\",mode=\"system\"} %.2f\n"
+                    "loadgen_cpu_load_percent{cpu=\"%d\",mode=\"irq\"} %.2f\n"
+                    "loadgen_cpu_load_percent{cpu=\"%d\",mode=\"softirq\"} %.2f\n"
+                    "loadgen_cpu_load_percent{cpu=\"%d\",mode=\"idle\"} %.2f\n",
+                    i, usage[i].user, i, usage[i].system, i, usage[i].irq,
+                    i, usage[i].softirq, i, usage[i].idle);
+    }
+
+    last = malloc(sizeof(struct lat_hist));
+    total = malloc(sizeof(struct lat_hist));
+    if (!last || !total)
+        err_exit("malloc");
+    fprintf(out, "# TYPE loadgen_timer_jitter_seconds summary\n"
+            "# UNIT loadgen_timer_jitter_seconds seconds\n"
+            "# HELP loadgen_timer_jitter_seconds Wake-up lateness of user "
+            "load workers; quantiles over the last second.\n");
+    for (i = 0; i < cpus_onln; i++) {
+        if (cpu_jitter(i, last, total) < 0)
+            continue;
+        for (j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++)
+            fprintf(out, "loadgen_timer_jitter_seconds{cpu=\"%d\","
+                    "quantile=\"%g\"} %.9f\n", i, quantiles[j],
+                    lat_hist_pct(last, quantiles[j] * 100) / NSEC_PER_SEC);
+        fprintf(out, "loadgen_timer_jitter_seconds_sum{cpu=\"%d\"} %.9f\n"
+                "loadgen_timer_jitter_seconds_count{cpu=\"%d\"} %lu\n",
+                i, total->sum / NSEC_PER_SEC, i, total->n);
+    }
+    free(last);
+    free(total);
+
+    fprintf(out, "# EOF\n");
+}
+
+static int cmd_load(FILE *out, char **save)
+{
+    char *cpu_s = strtok_r(NULL, " \t", save);
+    char *mode = strtok_r(NULL, " \t", save);
+    char *pct_s = strtok_r(NULL, " \t", save);
+    char *end = "";
+    long cpu = -1, pct;
+    int i, sys, ret = 0;
+
+    if (!cpu_s || !mode || !pct_s || strtok_r(NULL, " \t", save)) {
+        fprintf(out, "error: usage: load <cpu|all> <user|sys> <pct>\n");
+        return 0;
+    }
+    if (strcmp(cpu_s, "all") != 0) {
+        cpu = strtol(cpu_s, &end, 10);
+        if (end[0] != '\0' || cpu < 0 || cpu >= cpus_onln) {
+            fprintf(out, "error: invalid CPU: %s\n", cpu_s);
+            return 0;
+        }
+    }
+    if (strcmp(mode, "user") == 0)
+        sys = 0;
+    else if (strcmp(mode, "sys") == 0)
+        sys = 1;
+    else {
+        fprintf(out, "error: invalid load type: %s\n", mode);
+        return 0;
+    }
+    pct = strtol(pct_s, &end, 10);
+    if (end[0] != '\0' || pct < 0 || pct > 100) {
+        fprintf(out, "error: load should be in range [0-100]\n");
+        return 0;
+    }
+
+    for (i = cpu < 0 ? 0 : cpu; i < (cpu < 0 ? cpus_onln : cpu + 1); i++) {
+        ret = set_cpu_load(i, sys, pct);
+        if (ret < 0)
+            break;
+    }
+    if (ret < 0)
+        fprintf(out, "error: cannot set load of CPU %d: %s\n", i,
+                strerror(-ret));
+    else
+        fprintf(out, "ok\n");
+    return 0;
+}
+
+static int cmd_engine(FILE *out, char **save, int start)
+{
+    char *name = strtok_r(NULL, " \t", save);
+    const struct engine *e;
+    int ret;
+
+    e = name ? find_engine(name) : NULL;
+    if (!e) {
+        fprintf(out, "error: unknown engine: %s\n", name ? name : "");
+        return 0;
+    }
+
+    /* Engines say -EINVAL also about bad settings, so ask first */
+    if (start && !engine_enabled(e)) {
+        fprintf(out, "error: %s is not configured\n", e->name);
+        return 0;
+    }
+
+    ret = start ? engine_start(e) : engine_stop(e);
+    if (ret == -EALREADY)
+        fprintf(out, "error: %s is already running\n", e->name);
+    else if (ret == -ESRCH)
+        fprintf(out, "error: %s is not running\n", e->name);
+    else if (ret < 0)
+        fprintf(out, "error: cannot start %s: %s\n", e->name, strerror(-ret));
+    else
+        fprintf(out, "ok\n");
+    return 0;
+}
+
+/* Run one request line, writing the reply to out. Replies end with a
+ * line of "ok" or "error: <reason>". Returns 1 to shut down.
+ */
+static int daemon_command(FILE *out, char *line)
+{
+    char *save, *cmd;
+    int i;
+
+    cmd = strtok_r(line, " \t", &save);
+    if (!cmd) {
+        fprintf(out, "error: empty request\n");
+        return 0;
+    }
+
+    if (strcmp(cmd, "load") == 0)
+        return cmd_load(out, &save);
+    if (strcmp(cmd, "start") == 0)
+        return cmd_engine(out, &save, 1);
+    if (strcmp(cmd, "stop") == 0)
+        return cmd_engine(out, &save, 0);
+
+    if (strcmp(cmd, "loads") == 0) {
+        for (i = 0; i < cpus_onln; i++)
+            fprintf(out, "cpu%d user %d sys %d\n", i, get_cpu_load(i, 0),
+                    get_cpu_load(i, 1));
+    }
+    else if (strcmp(cmd, "engines") == 0) {
+        for (i = 0; engines[i]; i++)
+            fprintf(out, "%s %s\n", engines[i]->name,
+                    engine_running(engines[i]) ? "running" : "stopped");
+    }
+    else if (strcmp(cmd, "stats") == 0)
+        fputs(last_report ? last_report : "", out);
+    else if (strcmp(cmd, "metrics") == 0)
+        daemon_metrics(out);
+    else if (strcmp(cmd, "help") == 0)
+        fputs(help_text, out);
+    else if (strcmp(cmd, "shutdown") == 0) {
+        fprintf(out, "ok\n");
+        return 1;
+    }
+    else {
+        fprintf(out, "error: unknown command: %s\n", cmd);
+        return 0;
+    }
+
+    fprintf(out, "ok\n");
+    return 0;
+}
+
+static void client_close(struct client *c)
+{
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+/* Send as much of the queued reply as the socket takes */
+static void client_flush(struct client *c)
+{
+    ssize_t n;
+
+    while (c->out_off < c->out_len) {
+        n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                 MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            client_close(c);
+            return;
+        }
+        c->out_off += n;
+    }
+
+    free(c->out);
+    c->out = NULL;
+    c->out_len = c->out_off = 0;
+    if (c->closing)
+        client_close(c);
+}
+
+static void client_send(struct client *c, const char *buf, size_t len)
+{
+    char *out = realloc(c->out, c->out_len + len);
+
+    if (!out)
+        err_exit("realloc");
+    memcpy(out + c->out_len, buf, len);
+    c->out = out;
+    c->out_len += len;
+    client_flush(c);
+}
+
+/* Answer any HTTP request with the metrics, once its header is in */
+static void metrics_reply(struct client *c)
+{
+    char *reply;
+    size_t len;
+    FILE *out;
+
+    if (!strstr(c->buf, "\n\r\n") && !strstr(c->buf, "\n\n") &&
+        c->len < sizeof(c->buf) - 1)
+        return;
+
+    out = open_memstream(&reply, &len);
+    if (!out)
+        err_exit("open_memstream");
+    daemon_metrics(out);
+    fclose(out);
+
+    out = open_memstream(&c->out, &c->out_len);
+    if (!out)
+        err_exit("open_memstream");
+    fprintf(out, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: application/openmetrics-text; version=1.0.0; "
+            "charset=utf-8\r\nContent-Length: %zu\r\n\r\n", len);
+    fwrite(reply, 1, len, out);
+    fclose(out);
+    free(reply);
+
+    c->closing = 1;
+    c->len = 0;
+    client_flush(c);
+}
+
+/* Read what the client sent and answer every complete line */
+static int client_read(struct client *c)
+{
+    FILE *out;
+    char *nl, *reply;
+    size_t len;
+    ssize_t n;
+    int quit = 0;
+
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n <= 0) {
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            return 0;
+        client_close(c);
+        return 0;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+
+    if (c->http) {
+        metrics_reply(c);
+        return 0;
+    }
+
+    while (!quit && c->fd >= 0 && (nl = strchr(c->buf, '\n'))) {
+        *nl = '\0';
+        if (nl > c->buf && nl[-1] == '\r')
+            nl[-1] = '\0';
+
+        out = open_memstream(&reply, &len);
+        if (!out)
+            err_exit("open_memstream");
+        quit = daemon_command(out, c->buf);
+        fclose(out);
+
+        c->len -= nl + 1 - c->buf;
+        memmove(c->buf, nl + 1, c->len + 1);
+        client_send(c, reply, len);
+        free(reply);
+    }
+
+    if (c->fd >= 0 && c->len == sizeof(c->buf) - 1) {
+        static const char msg[] = "error: request too long\n";
+
+        c->closing = 1;
+        client_send(c, msg, sizeof(msg) - 1);
+    }
+
+    return quit;
+}
+
+static void client_accept(int listen_fd, int http)
+{
+    static const char msg[] = "error: too many clients\n";
+    int fd, i;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+
+    for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            clients[i].fd = fd;
+            clients[i].http = http;
+            return;
+        }
+    }
+
+    if (!http)
+        send(fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL);
+    close(fd);
+}
+
+/* The default socket goes where no other user can swap it: into
+ * $XDG_RUNTIME_DIR, or else a /tmp directory of our own with mode 0700.
+ */
+static const char *default_ctl_path(char *buf, size_t size)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    struct stat sb;
+
+    if (dir && dir[0] == '/') {
+        snprintf(buf, size, "%s/loadgen.sock", dir);
+        return buf;
+    }
+
+    snprintf(buf, size, "/tmp/loadgen-%u", (unsigned) getuid());
+    if (mkdir(buf, 0700) < 0 && errno != EEXIST)
+        err_exit(buf);
+    if (lstat(buf, &sb) < 0)
+        err_exit(buf);
+    if (!S_ISDIR(sb.st_mode) || sb.st_uid != getuid() ||
+        (sb.st_mode & 077)) {
+        fprintf(stderr, "%s: %s is not a private directory of ours\n",
+                progname, buf);
+        exit(EXIT_FAILURE);
+    }
+    strcat(buf, "/loadgen.sock");
+    return buf;
+}
+
+void daemon_init(const char *path, unsigned int metrics_port)
+{
+    static char def_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sockaddr_in in_addr = { .sin_family = AF_INET };
+    struct stat sb;
+    int i, one = 1;
+
+    if (!path)
+        path = default_ctl_path(def_path, sizeof(def_path));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: control socket path is too long\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    /* Remove a socket left behind by a previous run, nothing else */
+    if (lstat(path, &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode)) {
+            fprintf(stderr, "%s: %s exists and is not a socket\n", progname,
+                    path);
+            exit(EXIT_FAILURE);
+        }
+        unlink(path);
+    }
+
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ctl_fd < 0)
+        err_exit("socket");
+    if (bind(ctl_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err_exit(path);
+    if (listen(ctl_fd, DAEMON_MAX_CLIENTS) < 0)
+        err_exit("listen");
+    ctl_path = path;
+
+    if (metrics_port) {
+        metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metrics_fd < 0)
+            err_exit("socket");
+        setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        in_addr.sin_port = htons(metrics_port);
+        in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(metrics_fd, (struct sockaddr *) &in_addr,
+                 sizeof(in_addr)) < 0)
+            err_exit("bind");
+        if (listen(metrics_fd, 8) < 0)
+            err_exit("listen");
+    }
+
+    for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    times_prev = calloc(cpus_onln, sizeof(struct cpu_times));
+    if (!times_prev)
+        err_exit("calloc");
+    read_cpu_times(times_prev, cpus_onln);
+
+    fprintf(stderr, "%s: listening on %s\n", progname, path);
+}
+
+/* Serve requests until until_ns or a signal. Returns 1 on shutdown. */
+int daemon_poll(unsigned long until_ns)
+{
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 2];
+    int map[DAEMON_MAX_CLIENTS + 2];
+    unsigned long t = now_ns();
+    int i, n, nfds = 0, timeout;
+
+    timeout = t < until_ns ? (until_ns - t + 999999) / 1000000 : 0;
+
+    fds[nfds].fd = ctl_fd;
+    fds[nfds++].events = POLLIN;
+    if (metrics_fd >= 0) {
+        fds[nfds].fd = metrics_fd;
+        fds[nfds++].events = POLLIN;
+    }
+    /* Take no more requests from a client until it reads the replies */
+    for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0)
+            continue;
+        map[nfds] = i;
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds++].events = clients[i].out ? POLLOUT : POLLIN;
+    }
+
+    n = poll(fds, nfds, timeout);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        err_exit("poll");
+    }
+    if (!n)
+        return 0;
+
+    for (i = metrics_fd >= 0 ? 2 : 1; i < nfds; i++) {
+        if (!fds[i].revents)
+            continue;
+        if (clients[map[i]].out)
+            client_flush(&clients[map[i]]);
+        else if (client_read(&clients[map[i]]))
+            return 1;
+    }
+    if (fds[0].revents & POLLIN)
+        client_accept(ctl_fd, 0);
+    if (metrics_fd >= 0 && (fds[1].revents & POLLIN))
+        client_accept(metrics_fd, 1);
+
+    return 0;
+}
+
+/* Called after every report: keep it for the stats command and work
+ * out the achieved load for the metrics.
+ */
+void daemon_tick(const char *report)
+{
+    struct cpu_times *cur;
+    double total;
+    int i;
+
+    free(last_report);
+    last_report = strdup(report);
+
+    cur = calloc(cpus_onln, sizeof(struct cpu_times));
+    if (!usage)
+        usage = calloc(cpus_onln, sizeof(struct cpu_usage));
+    if (!cur || !usage || !last_report)
+        err_exit("calloc");
+    read_cpu_times(cur, cpus_onln);
+
+    for (i = 0; i < cpus_onln; i++) {
+        total = cpu_times_total(&cur[i]) - cpu_times_total(&times_prev[i]);
+        if (total <= 0)
+            continue;
+        usage[i].user = (cur[i].user + cur[i].nice - times_prev[i].user -
+                         times_prev[i].nice) * 100 / total;
+        usage[i].system = (cur[i].system - times_prev[i].system) * 100 / total;
+        usage[i].irq = (cur[i].irq - times_prev[i].irq) * 100 / total;
+        usage[i].softirq =
+            (cur[i].softirq - times_prev[i].softirq) * 100 / total;
+        usage[i].idle = (cur[i].idle + cur[i].iowait - times_prev[i].idle -
+                         times_prev[i].iowait) * 100 / total;
+    }
+
+    free(times_prev);
+    times_prev = cur;
+}
+
+void daemon_fini(void)
+{
+    int i;
+
+    for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        if (clients[i].fd >= 0)
+            client_close(&clients[i]);
+    if (metrics_fd >= 0)
+        close(metrics_fd);
+    close(ctl_fd);
+    unlink(ctl_path);
+
+    free(last_report);
+    free(times_prev);
+    free(usage);
+}
@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "loadgen.h"
+
+#define IO_MAX_DEPTH       1024
+#define IO_TIMEOUT_TAG     ((__u64) -1)
+#define IO_FILL_CHUNK      (1 << 20)
+#define IO_ALIGN           4096
+
+/* Per-job counters, shared with the parent */
+struct io_stats {
+    unsigned long ios;
+    unsigned long bytes;
+    unsigned long errors;
+    int engine;                /* engine the job ended up using */
+    struct lat_hist lat;
+};
+
+/* Raw io_uring: we don't depend on liburing */
+struct io_ring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int fixed;                 /* buffers are registered */
+};
+
+/* State of one job */
+struct io_job {
+    int ind;
+    int fd;
+    struct io_stats *st;
+    char *bufs[IO_MAX_DEPTH];
+    struct iovec iov[IO_MAX_DEPTH];
+    unsigned long submit_ns[IO_MAX_DEPTH];
+    int free_slots[IO_MAX_DEPTH];
+    int nfree;
+
+    unsigned long nblocks;     /* file size in blocks */
+    unsigned long seq_block;   /* next block for sequential access */
+    unsigned long rnd;         /* xorshift state */
+
+    unsigned long count;       /* I/Os per period, 0: unpaced */
+    unsigned long interval;    /* ns between paced I/Os */
+    unsigned long window;      /* active part of the period, ns */
+};
+
+static struct io_load io;
+static struct io_stats *stats;
+static pid_t *io_pids;
+static struct lat_hist *prev;
+static unsigned long prev_ios, prev_bytes, prev_errors;
+
+static const char *io_rw_names[] = {
+    [IO_READ] = "read",
+    [IO_WRITE] = "write",
+    [IO_RW] = "rw",
+    [IO_RANDREAD] = "randread",
+    [IO_RANDWRITE] = "randwrite",
+    [IO_RANDRW] = "randrw",
+};
+
+static const char *io_engine_names[] = {
+    [IO_ENGINE_URING] = "io_uring",
+    [IO_ENGINE_PSYNC] = "psync",
+};
+
+static unsigned long xorshift(unsigned long *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int io_is_write(struct io_job *job)
+{
+    switch (io.rw) {
+    case IO_WRITE:
+    case IO_RANDWRITE:
+        return 1;
+    case IO_RW:
+    case IO_RANDRW:
+        return xorshift(&job->rnd) & 1;
+    default:
+        return 0;
+    }
+}
+
+static off_t io_next_offset(struct io_job *job)
+{
+    unsigned long block;
+
+    if (io.rw >= IO_RANDREAD)
+        block = xorshift(&job->rnd) % job->nblocks;
+    else {
+        block = job->seq_block++;
+        if (job->seq_block == job->nblocks)
+            job->seq_block = 0;
+    }
+
+    return (off_t) block * io.bs;
+}
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+                          unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+                             unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int io_ring_init(struct io_ring *ring, struct io_job *job)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    void *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = io_uring_setup(io.depth + 1, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            goto err;
+    }
+
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto err;
+
+    ring->sq_head = sq_ptr + p.sq_off.head;
+    ring->sq_tail = sq_ptr + p.sq_off.tail;
+    ring->sq_mask = sq_ptr + p.sq_off.ring_mask;
+    ring->sq_array = sq_ptr + p.sq_off.array;
+    ring->cq_head = cq_ptr + p.cq_off.head;
+    ring->cq_tail = cq_ptr + p.cq_off.tail;
+    ring->cq_mask = cq_ptr + p.cq_off.ring_mask;
+    ring->cqes = cq_ptr + p.cq_off.cqes;
+
+    /* Registered buffers save page pinning on every I/O; they may fail
+     * with a low RLIMIT_MEMLOCK, then plain vectored I/O is used.
+     */
+    ring->fixed = io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+                                    job->iov, io.depth) == 0;
+    if (!ring->fixed && job->ind == 0)
+        fprintf(stderr, "%s: io_uring buffer registration failed: %s\n",
+                progname, strerror(errno));
+
+    return 0;
+
+err:
+    close(ring->fd);
+    return -1;
+}
+
+static struct io_uring_sqe *io_ring_get_sqe(struct io_ring *ring)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+static void io_ring_queue(struct io_ring *ring, struct io_job *job)
+{
+    struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+    int slot = job->free_slots[--job->nfree];
+    int wr = io_is_write(job);
+
+    sqe->fd = job->fd;
+    sqe->off = io_next_offset(job);
+    if (ring->fixed) {
+        sqe->opcode = wr ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (unsigned long) job->bufs[slot];
+        sqe->len = io.bs;
+        sqe->buf_index = slot;
+    }
+    else {
+        sqe->opcode = wr ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long) &job->iov[slot];
+        sqe->len = 1;
+    }
+    sqe->user_data = slot;
+    job->submit_ns[slot] = now_ns();
+}
+
+/* Timeout request waking io_uring_enter() at an absolute time */
+static void io_ring_queue_timeout(struct io_ring *ring,
+                                  struct __kernel_timespec *ts,
+                                  unsigned long ns)
+{
+    struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+
+    ts->tv_sec = ns / 1000000000UL;
+    ts->tv_nsec = ns % 1000000000UL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = IO_TIMEOUT_TAG;
+}
+
+static void io_account(struct io_job *job, int slot, long res)
+{
+    struct io_stats *st = job->st;
+
+    if (res != (long) io.bs) {
+        __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    lat_hist_add(&st->lat, now_ns() - job->submit_ns[slot]);
+    __atomic_fetch_add(&st->ios, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->bytes, res, __ATOMIC_RELAXED);
+}
+
+/* Reap completions; returns the number of finished I/Os */
+static unsigned int io_ring_reap(struct io_ring *ring, struct io_job *job,
+                                 int *timeout_pending)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int done = 0;
+    struct io_uring_cqe *cqe;
+
+    for (; head != tail; head++) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data == IO_TIMEOUT_TAG) {
+            *timeout_pending = 0;
+            continue;
+        }
+        io_account(job, cqe->user_data, cqe->res);
+        job->free_slots[job->nfree++] = cqe->user_data;
+        done++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return done;
+}
+
+static void io_uring_loop(struct io_ring *ring, struct io_job *job)
+{
+    struct __kernel_timespec ts;
+    unsigned long period, window_end, issued, due, t, wake;
+    unsigned int inflight = 0, to_submit, min_complete;
+    int timeout_pending = 0;
+
+    period = period_start_ns(job->ind, io.jobs);
+    sleep_until_ns(period);
+
+    while (1) {
+        window_end = period + job->window;
+        issued = 0;
+
+        while ((t = now_ns()) < window_end) {
+            due = (unsigned long) -1;
+            if (job->count) {
+                due = (t - period) / job->interval + 1;
+                if (due > job->count)
+                    due = job->count;
+            }
+
+            to_submit = 0;
+            while (inflight < io.depth && issued < due) {
+                io_ring_queue(ring, job);
+                issued++;
+                inflight++;
+                to_submit++;
+            }
+
+            /* Nothing more is due right now: sleep in the kernel until
+             * a completion or the next due time.
+             */
+            if (inflight < io.depth && !timeout_pending) {
+                wake = window_end;
+                if (issued < job->count &&
+                    period + issued * job->interval < wake)
+                    wake = period + issued * job->interval;
+                io_ring_queue_timeout(ring, &ts, wake);
+                timeout_pending = 1;
+                to_submit++;
+            }
+
+            min_complete = 1;
+            if (io_uring_enter(ring->fd, to_submit, min_complete,
+                               IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                err_exit("io_uring_enter");
+            inflight -= io_ring_reap(ring, job, &timeout_pending);
+        }
+
+        /* Let the period's I/O drain before the next period starts */
+        while (inflight) {
+            if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR)
+                err_exit("io_uring_enter");
+            inflight -= io_ring_reap(ring, job, &timeout_pending);
+        }
+
+        period += NSEC_PER_SEC;
+        sleep_until_ns(period);
+    }
+}
+
+static void io_psync_loop(struct io_job *job)
+{
+    unsigned long period, window_end, issued, t;
+    char *buf = job->bufs[0];
+    off_t off;
+    long res;
+
+    period = period_start_ns(job->ind, io.jobs);
+    sleep_until_ns(period);
+
+    while (1) {
+        window_end = period + job->window;
+
+        for (issued = 0; (t = now_ns()) < window_end; issued++) {
+            if (job->count) {
+                if (issued == job->count) {
+                    sleep_until_ns(window_end);
+                    break;
+                }
+                if (period + issued * job->interval > t)
+                    sleep_until_ns(period + issued * job->interval);
+            }
+
+            off = io_next_offset(job);
+            job->submit_ns[0] = now_ns();
+            if (io_is_write(job))
+                res = pwrite(job->fd, buf, io.bs, off);
+            else
+                res = pread(job->fd, buf, io.bs, off);
+            io_account(job, 0, res);
+        }
+
+        period += NSEC_PER_SEC;
+        sleep_until_ns(period);
+    }
+}
+
+static void io_job_func(void *arg)
+{
+    struct io_job *job;
+    struct io_ring ring;
+    unsigned long per_job;
+    unsigned int i;
+
+    job = calloc(1, sizeof(struct io_job));
+    if (!job)
+        err_exit("calloc");
+    job->ind = *(int *) arg;
+    job->st = &stats[job->ind];
+    job->rnd = 0x9e3779b97f4a7c15UL ^ (getpid() * 2654435761UL);
+    job->nblocks = io.size / io.bs;
+    job->seq_block = job->nblocks / io.jobs * job->ind;
+
+    job->fd = open(io.file, O_RDWR | (io.direct ? O_DIRECT : 0));
+    if (job->fd < 0)
+        err_exit("open");
+
+    for (i = 0; i < io.depth; i++) {
+        if (posix_memalign((void **) &job->bufs[i], IO_ALIGN, io.bs))
+            err_exit("posix_memalign");
+        memset(job->bufs[i], 0xa5, io.bs);
+        job->iov[i].iov_base = job->bufs[i];
+        job->iov[i].iov_len = io.bs;
+        job->free_slots[job->nfree++] = i;
+    }
+
+    /* Same schedule as the CPU load: 1 second periods, of which the
+     * first duty percent are active.
+     */
+    job->window = NSEC_PER_SEC / 100 * io.duty;
+    per_job = io.bw ? io.bw / io.bs : io.iops;
+    per_job = (per_job + io.jobs - 1) / io.jobs;
+    if (per_job) {
+        job->count = per_job;
+        job->interval = job->window / per_job;
+        if (!job->interval)
+            job->interval = 1;
+    }
+
+    if (io.engine == IO_ENGINE_URING) {
+        if (io_ring_init(&ring, job) == 0) {
+            job->st->engine = IO_ENGINE_URING;
+            io_uring_loop(&ring, job);
+        }
+        if (job->ind == 0)
+            fprintf(stderr, "%s: io_uring is not available (%s), "
+                    "falling back to psync\n", progname, strerror(errno));
+    }
+
+    job->st->engine = IO_ENGINE_PSYNC;
+    io_psync_loop(job);
+}
+
+/* Create the file or extend it to io.size with real data, so that reads
+ * don't hit holes, and check that the jobs will be able to open it.
+ */
+static int io_prepare_file(void)
+{
+    struct stat sb;
+    char *buf = NULL;
+    off_t off;
+    ssize_t n;
+    int fd, ret = 0;
+
+    fd = open(io.file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return err_ret(io.file);
+    if (fstat(fd, &sb) < 0) {
+        ret = err_ret(io.file);
+        goto out;
+    }
+
+    if (sb.st_size < (off_t) io.size) {
+        buf = malloc(IO_FILL_CHUNK);
+        if (!buf)
+            err_exit("malloc");
+        memset(buf, 0x5a, IO_FILL_CHUNK);
+
+        for (off = sb.st_size; off < (off_t) io.size; off += n) {
+            n = io.size - off < IO_FILL_CHUNK ? io.size - off : IO_FILL_CHUNK;
+            n = pwrite(fd, buf, n, off);
+            if (n == 0)
+                errno = ENOSPC;
+            if (n <= 0) {
+                ret = err_ret(io.file);
+                goto out;
+            }
+        }
+        if (fsync(fd) < 0) {
+            ret = err_ret(io.file);
+            goto out;
+        }
+    }
+
+    if (io.direct) {
+        close(fd);
+        fd = open(io.file, O_RDWR | O_DIRECT);
+        if (fd < 0)
+            return err_ret("O_DIRECT open");
+    }
+out:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int io_enabled(const struct sys_load *sys_load)
+{
+    return sys_load->io.file != NULL;
+}
+
+static int io_start(const struct sys_load *sys_load)
+{
+    int i, ret;
+
+    io = sys_load->io;
+    if (!io.bs)
+        io.bs = 4096;
+    if (!io.size)
+        io.size = 256UL << 20;
+    if (!io.depth)
+        io.depth = 1;
+    if (!io.jobs)
+        io.jobs = 1;
+    if (!io.duty)
+        io.duty = 100;
+
+    if (io.size < io.bs) {
+        fprintf(stderr, "%s: I/O file size is less than block size\n",
+                progname);
+        return -EINVAL;
+    }
+    if (io.direct && io.bs % 512) {
+        fprintf(stderr, "%s: O_DIRECT needs a block size multiple of 512\n",
+                progname);
+        return -EINVAL;
+    }
+
+    ret = io_prepare_file();
+    if (ret < 0)
+        return ret;
+
+    stats = shared_alloc(sizeof(struct io_stats) * io.jobs);
+    prev = calloc(io.jobs, sizeof(struct lat_hist));
+    io_pids = calloc(io.jobs, sizeof(pid_t));
+    if (!prev || !io_pids)
+        err_exit("calloc");
+    prev_ios = prev_bytes = prev_errors = 0;
+
+    for (i = 0; i < io.jobs; i++)
+        io_pids[i] = spawn_worker(io_job_func, &i, i % cpus_onln);
+    return 0;
+}
+
+static void io_stop(void)
+{
+    kill_workers(io_pids, io.jobs);
+    shared_free(stats, sizeof(struct io_stats) * io.jobs);
+    free(io_pids);
+    free(prev);
+    stats = NULL;
+}
+
+static void io_report(FILE *stream, double interval)
+{
+    struct lat_hist *lat, *snap;
+    unsigned long ios = 0, bytes = 0, errors = 0;
+    unsigned int i;
+
+    lat = calloc(1, sizeof(struct lat_hist));
+    snap = malloc(sizeof(struct lat_hist));
+    if (!lat || !snap)
+        err_exit("malloc");
+
+    for (i = 0; i < io.jobs; i++) {
+        ios += __atomic_load_n(&stats[i].ios, __ATOMIC_RELAXED);
+        bytes += __atomic_load_n(&stats[i].bytes, __ATOMIC_RELAXED);
+        errors += __atomic_load_n(&stats[i].errors, __ATOMIC_RELAXED);
+        lat_hist_snap(snap, &stats[i].lat, &prev[i]);
+        lat_hist_merge(lat, snap);
+    }
+
+    fprintf(stream, "io (%s %s bs %lu qd %u): %.0f iops %.1f MB/s, "
+            "lat us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f",
+            io_engine_names[stats[0].engine], io_rw_names[io.rw], io.bs,
+            io.depth, (ios - prev_ios) / interval,
+            (bytes - prev_bytes) / interval / 1e6,
+            lat_hist_pct(lat, 50) / 1e3, lat_hist_pct(lat, 90) / 1e3,
+            lat_hist_pct(lat, 99) / 1e3, lat_hist_pct(lat, 99.9) / 1e3,
+            lat->max / 1e3);
+    if (errors != prev_errors)
+        fprintf(stream, ", %lu errors", errors - prev_errors);
+    fprintf(stream, "\n");
+
+    prev_ios = ios;
+    prev_bytes = bytes;
+    prev_errors = errors;
+    free(lat);
+    free(snap);
+}
+
+const struct engine io_engine = {
+    .name = "io",
+    .enabled = io_enabled,
+    .start = io_start,
+    .stop = io_stop,
+    .report = io_report,
+};
@@ -9,9 +9,16 @@
 #include <net/sock.h>
 #include <linux/netlink.h>
 #include <linux/skbuff.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/pid.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/types.h>
+#include <linux/sched/task.h>
 #endif
 
 #include "cpu_nl.h"
@@ -19,6 +26,28 @@
 #define MSEC_IN_SEC    1000
 #define MS_TO_NS(x)    (x * 1000000)
 #define MS_TO_US(x)    (x * 1000)
+#define NSEC_IN_SEC    1000000000UL
+#define IRQ_MAX_HZ     100000
+/* Leave some time outside of interrupts, or the CPU locks up */
+#define IRQ_MAX_NS     (NSEC_IN_SEC / 10 * 9)
+#define IDLE_MAX_PCT   95
+#define SCHED_MAX_TASKS 100000     /* per CPU and on all CPUs together */
+
+/* Idle injection needs play_idle(), which appeared in 4.10 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#define HAVE_PLAY_IDLE
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+#define kvcalloc(n, size, flags)    kcalloc(n, size, flags)
+#endif
+
+/* Interrupt timers must expire in hard interrupt context even on RT */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#define IRQ_HRTIMER_MODE    HRTIMER_MODE_REL_PINNED_HARD
+#else
+#define IRQ_HRTIMER_MODE    HRTIMER_MODE_REL_PINNED
+#endif
 
 struct hog_thread_data {
     bool cpu_active;
@@ -27,11 +56,50 @@ struct hog_thread_data {
     unsigned long work_time_ms;
     unsigned long sleep_time_ms;
     bool is_running;
+    u64 hog_busy_ns;
+    u64 hog_start_ns;
+
+    /* Interrupt load */
+    bool irq_active;
+    bool irq_started;          /* timers set up by kloadgend_run_threads() */
+    struct hrtimer irq_hrtimer;
+    struct hrtimer softirq_hrtimer;
+    struct tasklet_struct softirq_tasklet;
+    unsigned long hardirq_period_ns;
+    unsigned long hardirq_cost_ns;
+    unsigned long softirq_period_ns;
+    unsigned long softirq_cost_ns;
+
+    /* Idle injection */
+    bool idle_active;
+    struct task_struct *idle_thread;
+    unsigned long idle_ns;
+    unsigned long idle_period_ns;
+    u64 idle_injected_ns;
+    u64 idle_start_ns;
+
+    /* Scheduler stress */
+    unsigned int sched_nr_tasks;
+    unsigned long sched_work_ns;
+    unsigned long sched_period_ns;
+    bool sched_pin;
+    bool sched_stop;
+    struct sched_task_data *sched_tasks;
 };
 static struct hog_thread_data *hog_data;
 
+struct sched_task_data {
+    struct hog_thread_data *cpu_data;
+    unsigned int index;
+    struct task_struct *task;
+};
+
 static struct sock *nl_sk = NULL;
 static unsigned int num_cpus = 0;
+/* CPU loads received after NL_RUN_THREADS take effect at once */
+static bool threads_running;
+/* Requests of several processes may come in at the same time */
+static DEFINE_MUTEX(nl_mutex);
 
 static enum hrtimer_restart hog_hrtimer_callback(struct hrtimer *timer)
 {
@@ -51,9 +119,105 @@ static enum hrtimer_restart hog_hrtimer_callback(struct hrtimer *timer)
     return HRTIMER_RESTART;
 }
 
+static void burn_ns(unsigned long ns)
+{
+    u64 end = ktime_get_ns() + ns;
+
+    while (ktime_get_ns() < end)
+        cpu_relax();
+}
+
+static enum hrtimer_restart irq_hrtimer_callback(struct hrtimer *timer)
+{
+    struct hog_thread_data *data = container_of(timer,
+                                                struct hog_thread_data,
+                                                irq_hrtimer);
+
+    burn_ns(data->hardirq_cost_ns);
+    hrtimer_forward_now(timer, ns_to_ktime(data->hardirq_period_ns));
+
+    return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart softirq_hrtimer_callback(struct hrtimer *timer)
+{
+    struct hog_thread_data *data = container_of(timer,
+                                                struct hog_thread_data,
+                                                softirq_hrtimer);
+
+    /* The tasklet runs in softirq on the CPU it was scheduled from */
+    tasklet_schedule(&data->softirq_tasklet);
+    hrtimer_forward_now(timer, ns_to_ktime(data->softirq_period_ns));
+
+    return HRTIMER_RESTART;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+static void softirq_tasklet_fn(struct tasklet_struct *t)
+{
+    struct hog_thread_data *data = from_tasklet(data, t, softirq_tasklet);
+#else
+static void softirq_tasklet_fn(unsigned long d)
+{
+    struct hog_thread_data *data = (struct hog_thread_data *)d;
+#endif
+
+    burn_ns(data->softirq_cost_ns);
+}
+
+/* Runs on the target CPU, so that pinned timers stay there */
+static void irq_timers_start(void *d)
+{
+    struct hog_thread_data *data = (struct hog_thread_data *)d;
+
+    if (data->hardirq_period_ns)
+        hrtimer_start(&data->irq_hrtimer,
+                      ns_to_ktime(data->hardirq_period_ns), IRQ_HRTIMER_MODE);
+    if (data->softirq_period_ns)
+        hrtimer_start(&data->softirq_hrtimer,
+                      ns_to_ktime(data->softirq_period_ns), IRQ_HRTIMER_MODE);
+}
+
+static void irq_timers_init(struct hog_thread_data *data)
+{
+    hrtimer_init(&data->irq_hrtimer, CLOCK_MONOTONIC, IRQ_HRTIMER_MODE);
+    data->irq_hrtimer.function = irq_hrtimer_callback;
+    hrtimer_init(&data->softirq_hrtimer, CLOCK_MONOTONIC, IRQ_HRTIMER_MODE);
+    data->softirq_hrtimer.function = softirq_hrtimer_callback;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    tasklet_setup(&data->softirq_tasklet, softirq_tasklet_fn);
+#else
+    tasklet_init(&data->softirq_tasklet, softirq_tasklet_fn,
+                 (unsigned long) data);
+#endif
+}
+
+static void irq_timers_stop(struct hog_thread_data *data)
+{
+    hrtimer_cancel(&data->irq_hrtimer);
+    hrtimer_cancel(&data->softirq_hrtimer);
+    tasklet_kill(&data->softirq_tasklet);
+}
+
+/* Unlike usleep_range(), the sleep ends early when the thread is woken
+ * up, by kthread_stop() or once *stop is set.
+ */
+static void kthread_sleep_ns(u64 ns, const bool *stop)
+{
+    ktime_t timeout = ns_to_ktime(ns);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (kthread_should_stop() || (stop && READ_ONCE(*stop))) {
+        __set_current_state(TASK_RUNNING);
+        return;
+    }
+    schedule_hrtimeout_range(&timeout, 50 * NSEC_PER_USEC, HRTIMER_MODE_REL);
+}
+
 static int hog_threadfn(void *d)
 {
     struct hog_thread_data *data = (struct hog_thread_data *)d;
+    u64 t;
 
     hrtimer_init(&data->hog_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     data->hog_hrtimer.function = hog_hrtimer_callback;
@@ -63,11 +227,13 @@ static int hog_threadfn(void *d)
 
     data->is_running = true;
     while (!kthread_should_stop()) {
-        while (data->is_running)
+        t = ktime_get_ns();
+        while (data->is_running && !kthread_should_stop())
             cpu_relax();
+        WRITE_ONCE(data->hog_busy_ns,
+                   data->hog_busy_ns + ktime_get_ns() - t);
 
-        usleep_range(MS_TO_US(data->sleep_time_ms),
-                     MS_TO_US(data->sleep_time_ms));
+        kthread_sleep_ns(MS_TO_NS((u64) data->sleep_time_ms), NULL);
     }
 
     printk(KERN_INFO "[%s]: Cancel timer\n", KMOD_NAME);
@@ -78,7 +244,163 @@ static int hog_threadfn(void *d)
     do_exit(0);
 }
 
-static void nl_send_ack(const struct nlmsghdr *nlh)
+#ifdef HAVE_PLAY_IDLE
+static void force_idle(u64 ns)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    play_idle_precise(ns, U64_MAX);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+    play_idle(div_u64(ns, NSEC_PER_USEC));
+#else
+    play_idle(div_u64(ns, NSEC_PER_MSEC));
+#endif
+}
+
+/* Like intel_powerclamp: a bound SCHED_FIFO kthread takes the CPU and
+ * puts it into idle for idle_ns out of every idle_period_ns, so nothing
+ * else can run there meanwhile.
+ */
+static int idle_threadfn(void *d)
+{
+    struct hog_thread_data *data = (struct hog_thread_data *)d;
+    u64 next, t, rem;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+    struct sched_param param = { .sched_priority = MAX_RT_PRIO / 2 };
+
+    sched_setscheduler(current, SCHED_FIFO, &param);
+#else
+    sched_set_fifo(current);
+#endif
+
+    next = ktime_get_ns();
+    while (!kthread_should_stop()) {
+        t = ktime_get_ns();
+        force_idle(data->idle_ns);
+        WRITE_ONCE(data->idle_injected_ns,
+                   data->idle_injected_ns + ktime_get_ns() - t);
+
+        next += data->idle_period_ns;
+        t = ktime_get_ns();
+        if (next > t) {
+            rem = div_u64(next - t, NSEC_PER_USEC);
+            usleep_range(rem, rem);
+        }
+        else
+            next = t;
+    }
+
+    printk(KERN_INFO "[%s]: %s stopping\n", KMOD_NAME, current->comm);
+    return 0;
+}
+#endif /* HAVE_PLAY_IDLE */
+
+/* One of many short-running kthreads on a CPU: wakes once per period,
+ * phase-shifted by its index, and burns sched_work_ns.
+ */
+static int sched_threadfn(void *d)
+{
+    struct sched_task_data *task = (struct sched_task_data *)d;
+    struct hog_thread_data *data = task->cpu_data;
+    u64 next, t;
+
+    next = ktime_get_ns() + div_u64((u64)data->sched_period_ns * task->index,
+                                    data->sched_nr_tasks);
+    while (!kthread_should_stop() && !READ_ONCE(data->sched_stop)) {
+        t = ktime_get_ns();
+        if (next > t) {
+            kthread_sleep_ns(next - t, &data->sched_stop);
+            continue;
+        }
+
+        burn_ns(data->sched_work_ns);
+        cond_resched();
+
+        next += data->sched_period_ns;
+        if (next < t)
+            next = t + data->sched_period_ns;
+    }
+
+    return 0;
+}
+
+/* Threads created before a failure are left for sched_threads_stop() */
+static int sched_threads_start(struct hog_thread_data *data, int cpu)
+{
+    struct sched_task_data *tasks;
+    unsigned int i;
+    int err;
+
+    tasks = kvcalloc(data->sched_nr_tasks, sizeof(*tasks), GFP_KERNEL);
+    if (!tasks) {
+        printk(KERN_ERR "[%s]: kvcalloc failed\n", KMOD_NAME);
+        return -ENOMEM;
+    }
+    data->sched_tasks = tasks;
+    data->sched_stop = false;
+
+    for (i = 0; i < data->sched_nr_tasks; i++) {
+        tasks[i].cpu_data = data;
+        tasks[i].index = i;
+        tasks[i].task = kthread_create_on_node(sched_threadfn, &tasks[i],
+                                               cpu_to_node(cpu),
+                                               "%s/sched%d:%u",
+                                               KMOD_NAME, cpu, i);
+        if (IS_ERR(tasks[i].task)) {
+            printk(KERN_ERR "[%s]: Thread creation failed after %u "
+                   "threads on CPU %d\n", KMOD_NAME, i, cpu);
+            err = PTR_ERR(tasks[i].task);
+            tasks[i].task = NULL;
+            return err;
+        }
+        /* The thread may exit before sched_threads_stop() reaps it */
+        get_task_struct(tasks[i].task);
+        if (data->sched_pin)
+            kthread_bind(tasks[i].task, cpu);
+        wake_up_process(tasks[i].task);
+    }
+
+    return 0;
+}
+
+/* Tell all threads of a CPU to exit at once: kthread_stop() waits for
+ * each thread in turn, which takes long with thousands of them.
+ */
+static void sched_threads_signal(struct hog_thread_data *data)
+{
+    unsigned int i;
+
+    if (!data->sched_tasks)
+        return;
+
+    WRITE_ONCE(data->sched_stop, true);
+    smp_mb();
+    for (i = 0; i < data->sched_nr_tasks && data->sched_tasks[i].task; i++)
+        wake_up_process(data->sched_tasks[i].task);
+}
+
+static int sched_threads_stop(struct hog_thread_data *data)
+{
+    unsigned int i;
+    int cnt = 0;
+
+    if (!data->sched_tasks)
+        return 0;
+
+    for (i = 0; i < data->sched_nr_tasks; i++) {
+        if (!data->sched_tasks[i].task)
+            break;
+        kthread_stop(data->sched_tasks[i].task);
+        put_task_struct(data->sched_tasks[i].task);
+        cnt++;
+    }
+    kvfree(data->sched_tasks);
+    data->sched_tasks = NULL;
+
+    return cnt;
+}
+
+/* Acknowledge a request, or reject it with a negative errno */
+static void nl_send_ack(const struct nlmsghdr *nlh, int error)
 {
     struct sk_buff *skb_out;
     struct nlmsgerr err;
@@ -91,7 +413,7 @@ static void nl_send_ack(const struct nlmsghdr *nlh)
     }
 
     memset((void *) &err, 0, sizeof(struct nlmsgerr));
-    err.error = 0;        /* 0 for acknowledgement */
+    err.error = error;    /* 0 for acknowledgement */
     err.msg = *nlh;       /* header causing acknowledgment response */
 
     /* Now nlh points to header of a new netlink message put to buffer */
@@ -104,25 +426,114 @@ static void nl_send_ack(const struct nlmsghdr *nlh)
         printk(KERN_INFO "[%s]: Error while sending back to user\n", KMOD_NAME);
 }
 
-static void kloadgend_run_threads(void)
+/* Reply with a packet carrying data; the ack follows it */
+static void nl_send_data(const struct nlmsghdr *nlh,
+                         const struct nl_packet *reply)
 {
-    int i;
+    struct sk_buff *skb_out;
+    struct nlmsghdr *nlh_out;
 
-    printk(KERN_INFO "[%s]: Running kthreads\n", KMOD_NAME);
-    for (i = 0; i < num_cpus; ++i) {
-        if (!hog_data[i].cpu_active)
-            continue;
+    skb_out = nlmsg_new(sizeof(struct nl_packet), 0);
+    if (!skb_out) {
+        printk(KERN_ERR "[%s]: Failed to allocate new skb\n", KMOD_NAME);
+        return;
+    }
 
-        hog_data[i].hog_thread = kthread_create(hog_threadfn,
-                                                &(hog_data[i]),
-                                                "%s%d", KMOD_NAME, i);
-        if (IS_ERR(hog_data[i].hog_thread))
-            printk(KERN_ERR "[%s]: Thread creation failed\n", KMOD_NAME);
-        else {
-            kthread_bind(hog_data[i].hog_thread, i);
-            wake_up_process(hog_data[i].hog_thread);
+    nlh_out = nlmsg_put(skb_out, 0, nlh->nlmsg_seq, NLMSG_CPUHOG_DATA,
+                        sizeof(struct nl_packet), 0);
+    NETLINK_CB(skb_out).dst_group = 0;    /* not in mcast group */
+    memcpy(nlmsg_data(nlh_out), reply, sizeof(struct nl_packet));
+
+    if (nlmsg_unicast(nl_sk, skb_out, nlh->nlmsg_pid) < 0)
+        printk(KERN_INFO "[%s]: Error while sending back to user\n", KMOD_NAME);
+}
+
+static int hog_thread_start(int cpu)
+{
+    struct task_struct *t;
+
+    t = kthread_create(hog_threadfn, &(hog_data[cpu]), "%s%d", KMOD_NAME,
+                       cpu);
+    if (IS_ERR(t)) {
+        printk(KERN_ERR "[%s]: Thread creation failed\n", KMOD_NAME);
+        return PTR_ERR(t);
+    }
+    hog_data[cpu].hog_thread = t;
+    hog_data[cpu].hog_busy_ns = 0;
+    hog_data[cpu].hog_start_ns = ktime_get_ns();
+    kthread_bind(t, cpu);
+    wake_up_process(t);
+    return 0;
+}
+
+static int hog_thread_stop(int cpu)
+{
+    if (!hog_data[cpu].hog_thread)
+        return 0;
+
+    kthread_stop(hog_data[cpu].hog_thread);
+    hog_data[cpu].hog_thread = NULL;
+    return 1;
+}
+
+#ifdef HAVE_PLAY_IDLE
+static int idle_thread_start(int cpu)
+{
+    struct task_struct *t;
+
+    t = kthread_create(idle_threadfn, &(hog_data[cpu]), "%s/idle%d",
+                       KMOD_NAME, cpu);
+    if (IS_ERR(t)) {
+        printk(KERN_ERR "[%s]: Thread creation failed\n", KMOD_NAME);
+        return PTR_ERR(t);
+    }
+    hog_data[cpu].idle_thread = t;
+    hog_data[cpu].idle_injected_ns = 0;
+    hog_data[cpu].idle_start_ns = ktime_get_ns();
+    kthread_bind(t, cpu);
+    wake_up_process(t);
+    return 0;
+}
+#endif
+
+static void kloadgend_stop_threads(void);
+
+/* Start everything configured; if anything fails, what was started is
+ * stopped again and the error returned.
+ */
+static int kloadgend_run_threads(void)
+{
+    int i, err = 0;
+
+    printk(KERN_INFO "[%s]: Running kthreads\n", KMOD_NAME);
+    for (i = 0; i < num_cpus && !err; ++i) {
+        if (hog_data[i].irq_active) {
+            irq_timers_init(&hog_data[i]);
+            hog_data[i].irq_started = true;
+            if (smp_call_function_single(i, irq_timers_start,
+                                         &hog_data[i], 1)) {
+                printk(KERN_ERR "[%s]: Failed to start interrupt load on "
+                       "CPU %d\n", KMOD_NAME, i);
+                hog_data[i].irq_active = false;
+            }
         }
+
+#ifdef HAVE_PLAY_IDLE
+        if (hog_data[i].idle_active)
+            err = idle_thread_start(i);
+#endif
+
+        if (!err && hog_data[i].sched_nr_tasks)
+            err = sched_threads_start(&hog_data[i], i);
+
+        if (!err && hog_data[i].cpu_active)
+            err = hog_thread_start(i);
     }
+    threads_running = true;
+
+    if (err)
+        kloadgend_stop_threads();
+    return err;
 }
 
 static void kloadgend_stop_threads(void)
@@ -133,37 +544,51 @@ static void kloadgend_stop_threads(void)
     if (!hog_data)
         return;
 
+    for (i = 0; i < num_cpus; i++)
+        sched_threads_signal(&hog_data[i]);
+
     for (i = 0; i < num_cpus; i++) {
-        if (hog_data[i].cpu_active &&
-                hog_data[i].hog_thread &&
-                !IS_ERR(hog_data[i].hog_thread)) {
-            kthread_stop(hog_data[i].hog_thread);
-            hog_data[i].hog_thread = NULL;
+        if (hog_data[i].irq_started) {
+            irq_timers_stop(&hog_data[i]);
+            hog_data[i].irq_started = false;
+            hog_data[i].irq_active = false;
+            cnt++;
+        }
+        if (hog_data[i].idle_thread) {
+            kthread_stop(hog_data[i].idle_thread);
+            hog_data[i].idle_thread = NULL;
             cnt++;
         }
+        cnt += sched_threads_stop(&hog_data[i]);
+        cnt += hog_thread_stop(i);
     }
+    threads_running = false;
 
     if (cnt)
-        printk(KERN_INFO "[%s]: Kthreads are terminated\n", KMOD_NAME);
+        printk(KERN_INFO "[%s]: Kthreads and timers are terminated\n",
+               KMOD_NAME);
 }
 
-static bool nl_check_pid_and_seq(pid_t pid, pid_t prev_pid,
-                                 int seq, int prev_seq)
+/* Requests of another process are refused while one is connected,
+ * from its NL_INIT to its NL_STOP_THREADS
+ */
+static int nl_check_pid_and_seq(pid_t pid, pid_t prev_pid,
+                                int seq, int prev_seq)
 {
     if (pid != prev_pid) {
         printk(KERN_ERR "[%s]: nlmsg pid mismatch: "
                "should be %d, but received %d\n",
                KMOD_NAME, prev_pid, pid);
-        return false;
+        return -EBUSY;
     }
     if (seq != prev_seq + 1) {
         printk(KERN_ERR "[%s]: nlmsg sequence number mismatch: "
                "should be %d, but received %d\n",
                KMOD_NAME, prev_seq + 1, seq);
-        return false;
+        return -EPROTO;
     }
 
-    return true;
+    return 0;
 }
 
 static inline void reset_hog_data(void)
@@ -171,11 +596,29 @@ static inline void reset_hog_data(void)
     memset((void *) hog_data, 0, sizeof(struct hog_thread_data) * num_cpus);
 }
 
-static void nl_recv_msg(struct sk_buff *skb)
+/* A process that died without NL_STOP_THREADS doesn't keep the module */
+static bool nl_owner_alive(pid_t pid)
+{
+    bool alive;
+
+    rcu_read_lock();
+    alive = pid_task(find_vpid(pid), PIDTYPE_PID) != NULL;
+    rcu_read_unlock();
+
+    return alive;
+}
+
+static void nl_recv_msg_locked(struct sk_buff *skb)
 {
     struct nlmsghdr *nlh;
     struct nl_packet *packet;
     unsigned int cpu_num, load_msec;
+    struct irq_load *irq_load;
+    struct idle_load *idle_load;
+    struct sched_load *sched_load;
+    struct nl_packet reply;
+    unsigned long total;
+    int i, err = 0;
 
     static pid_t pid = 0;
     static int seq = -1;
@@ -189,15 +632,34 @@ static void nl_recv_msg(struct sk_buff *skb)
             printk(KERN_ERR "[%s]: nlmsg sequence number "
                    "mismatch: should be 0, but received %d\n",
                    KMOD_NAME, nlh->nlmsg_seq);
+            nl_send_ack(nlh, -EPROTO);
+            return;
+        }
+        /* Setting up again on running threads would reinit live
+         * timers and leak the threads.
+         */
+        if (pid && pid != nlh->nlmsg_pid && nl_owner_alive(pid)) {
+            printk(KERN_ERR "[%s]: in use by process %d\n", KMOD_NAME, pid);
+            nl_send_ack(nlh, -EBUSY);
             return;
         }
+        if (pid == nlh->nlmsg_pid && threads_running) {
+            printk(KERN_ERR "[%s]: threads are running, stop them first\n",
+                   KMOD_NAME);
+            nl_send_ack(nlh, -EBUSY);
+            return;
+        }
+        kloadgend_stop_threads();
+        reset_hog_data();
         break;
 
     case NL_CPU_LOAD:
         /* Here we receive CPU loads */
-        if (!nl_check_pid_and_seq(nlh->nlmsg_pid, pid,
-                                  nlh->nlmsg_seq, seq))
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
             return;
+        }
 
         cpu_num = (packet->cpu_load).cpu_num;
         load_msec = (packet->cpu_load).load_msec;
@@ -205,33 +667,235 @@ static void nl_recv_msg(struct sk_buff *skb)
         if (cpu_num >= num_cpus) {
             printk(KERN_ERR "[%s]: CPU number %u is too large\n",
                    KMOD_NAME, cpu_num);
-            return;
+            err = -EINVAL;
+            break;
         }
         if (load_msec > MSEC_IN_SEC) {
             printk(KERN_ERR "[%s]: load of %u msec is too large\n",
                    KMOD_NAME, load_msec);
-            return;
+            err = -EINVAL;
+            break;
         }
 
+        /* A running hog thread picks the new times up on its next
+         * timer expiry; a zero load stops it, before it could start
+         * a full second of sleep.
+         */
+        if (threads_running && !load_msec)
+            hog_thread_stop(cpu_num);
         hog_data[cpu_num].work_time_ms = load_msec;
         hog_data[cpu_num].sleep_time_ms =
             MSEC_IN_SEC - hog_data[cpu_num].work_time_ms;
-        hog_data[cpu_num].cpu_active = true;
+        if (threads_running && load_msec && !hog_data[cpu_num].cpu_active) {
+            err = hog_thread_start(cpu_num);
+            if (err)
+                break;
+        }
+        hog_data[cpu_num].cpu_active = load_msec != 0;
+
+        break;
+
+    case NL_IRQ_LOAD:
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
+            return;
+        }
+
+        irq_load = &packet->irq_load;
+        if (irq_load->cpu_num >= num_cpus) {
+            printk(KERN_ERR "[%s]: CPU number %u is too large\n",
+                   KMOD_NAME, irq_load->cpu_num);
+            err = -EINVAL;
+            break;
+        }
+        if (irq_load->hardirq_hz > IRQ_MAX_HZ ||
+            irq_load->softirq_hz > IRQ_MAX_HZ) {
+            printk(KERN_ERR "[%s]: interrupt rate is too large\n",
+                   KMOD_NAME);
+            err = -EINVAL;
+            break;
+        }
+        if ((u64) irq_load->hardirq_hz * irq_load->hardirq_ns +
+            (u64) irq_load->softirq_hz * irq_load->softirq_ns > IRQ_MAX_NS) {
+            printk(KERN_ERR "[%s]: interrupt load is over 90%%\n",
+                   KMOD_NAME);
+            err = -EINVAL;
+            break;
+        }
+
+        cpu_num = irq_load->cpu_num;
+        hog_data[cpu_num].hardirq_period_ns = irq_load->hardirq_hz ?
+            NSEC_IN_SEC / irq_load->hardirq_hz : 0;
+        hog_data[cpu_num].hardirq_cost_ns = irq_load->hardirq_ns;
+        hog_data[cpu_num].softirq_period_ns = irq_load->softirq_hz ?
+            NSEC_IN_SEC / irq_load->softirq_hz : 0;
+        hog_data[cpu_num].softirq_cost_ns = irq_load->softirq_ns;
+        hog_data[cpu_num].irq_active = irq_load->hardirq_hz ||
+                                       irq_load->softirq_hz;
+
+        break;
+
+    case NL_IDLE_LOAD:
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
+            return;
+        }
+
+#ifndef HAVE_PLAY_IDLE
+        printk(KERN_ERR "[%s]: idle injection needs Linux 4.10 or later\n",
+               KMOD_NAME);
+        err = -EOPNOTSUPP;
+        break;
+#endif
+        idle_load = &packet->idle_load;
+        if (idle_load->cpu_num >= num_cpus) {
+            printk(KERN_ERR "[%s]: CPU number %u is too large\n",
+                   KMOD_NAME, idle_load->cpu_num);
+            err = -EINVAL;
+            break;
+        }
+        if (idle_load->idle_pct > IDLE_MAX_PCT ||
+            !idle_load->period_ms || idle_load->period_ms > MSEC_IN_SEC) {
+            printk(KERN_ERR "[%s]: idle injection of %u%% in %u msec "
+                   "is out of range\n", KMOD_NAME, idle_load->idle_pct,
+                   idle_load->period_ms);
+            err = -EINVAL;
+            break;
+        }
+
+        cpu_num = idle_load->cpu_num;
+        hog_data[cpu_num].idle_period_ns = MS_TO_NS(idle_load->period_ms);
+        hog_data[cpu_num].idle_ns =
+            hog_data[cpu_num].idle_period_ns / 100 * idle_load->idle_pct;
+        hog_data[cpu_num].idle_active = idle_load->idle_pct != 0;
+
+        break;
+
+    case NL_IDLE_STATS:
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
+            return;
+        }
+
+        cpu_num = packet->idle_stats.cpu_num;
+        if (cpu_num >= num_cpus) {
+            printk(KERN_ERR "[%s]: CPU number %u is too large\n",
+                   KMOD_NAME, cpu_num);
+            err = -EINVAL;
+            break;
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        reply.packet_type = NL_IDLE_STATS;
+        reply.idle_stats.cpu_num = cpu_num;
+        if (hog_data[cpu_num].idle_thread) {
+            reply.idle_stats.injected_ns =
+                READ_ONCE(hog_data[cpu_num].idle_injected_ns);
+            reply.idle_stats.elapsed_ns =
+                ktime_get_ns() - hog_data[cpu_num].idle_start_ns;
+        }
+        nl_send_data(nlh, &reply);
+
+        break;
+
+    case NL_CPU_STATS:
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
+            return;
+        }
+
+        cpu_num = packet->cpu_stats.cpu_num;
+        if (cpu_num >= num_cpus) {
+            printk(KERN_ERR "[%s]: CPU number %u is too large\n",
+                   KMOD_NAME, cpu_num);
+            err = -EINVAL;
+            break;
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        reply.packet_type = NL_CPU_STATS;
+        reply.cpu_stats.cpu_num = cpu_num;
+        if (hog_data[cpu_num].hog_thread) {
+            reply.cpu_stats.busy_ns =
+                READ_ONCE(hog_data[cpu_num].hog_busy_ns);
+            reply.cpu_stats.elapsed_ns =
+                ktime_get_ns() - hog_data[cpu_num].hog_start_ns;
+        }
+        nl_send_data(nlh, &reply);
+
+        break;
+
+    case NL_SCHED_LOAD:
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
+            return;
+        }
+
+        sched_load = &packet->sched_load;
+        if (sched_load->cpu_num >= num_cpus) {
+            printk(KERN_ERR "[%s]: CPU number %u is too large\n",
+                   KMOD_NAME, sched_load->cpu_num);
+            err = -EINVAL;
+            break;
+        }
+        if (sched_load->nr_tasks > SCHED_MAX_TASKS ||
+            !sched_load->period_us ||
+            (u64)sched_load->work_ns * sched_load->nr_tasks >
+            (u64)sched_load->period_us * NSEC_PER_USEC) {
+            printk(KERN_ERR "[%s]: %u tasks of %u nsec in %u usec "
+                   "are out of range\n", KMOD_NAME, sched_load->nr_tasks,
+                   sched_load->work_ns, sched_load->period_us);
+            err = -EINVAL;
+            break;
+        }
+
+        cpu_num = sched_load->cpu_num;
+        total = sched_load->nr_tasks;
+        for (i = 0; i < num_cpus; i++)
+            if (i != cpu_num)
+                total += hog_data[i].sched_nr_tasks;
+        if (total > SCHED_MAX_TASKS) {
+            printk(KERN_ERR "[%s]: more than %u sched tasks on all CPUs\n",
+                   KMOD_NAME, SCHED_MAX_TASKS);
+            err = -EINVAL;
+            break;
+        }
+
+        hog_data[cpu_num].sched_nr_tasks = sched_load->nr_tasks;
+        hog_data[cpu_num].sched_work_ns = sched_load->work_ns;
+        hog_data[cpu_num].sched_period_ns =
+            (unsigned long)sched_load->period_us * NSEC_PER_USEC;
+        hog_data[cpu_num].sched_pin = sched_load->pin;
 
         break;
 
     case NL_RUN_THREADS:
         /* Run all threads at once. */
-        if (!nl_check_pid_and_seq(nlh->nlmsg_pid, pid,
-                                  nlh->nlmsg_seq, seq))
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
             return;
-        kloadgend_run_threads();
+        }
+        if (threads_running) {
+            printk(KERN_ERR "[%s]: threads are already running\n",
+                   KMOD_NAME);
+            err = -EBUSY;
+            break;
+        }
+        err = kloadgend_run_threads();
         break;
 
     case NL_STOP_THREADS:
-        if (!nl_check_pid_and_seq(nlh->nlmsg_pid, pid,
-                                  nlh->nlmsg_seq, seq))
+        err = nl_check_pid_and_seq(nlh->nlmsg_pid, pid, nlh->nlmsg_seq, seq);
+        if (err) {
+            nl_send_ack(nlh, err);
             return;
+        }
         kloadgend_stop_threads();
         reset_hog_data();
         break;
@@ -242,12 +906,19 @@ static void nl_recv_msg(struct sk_buff *skb)
     }
 
     seq = nlh->nlmsg_seq;
-    pid = nlh->nlmsg_pid;
-    nl_send_ack(nlh);
+    pid = packet->packet_type == NL_STOP_THREADS ? 0 : nlh->nlmsg_pid;
+    nl_send_ack(nlh, err);
 
     return;
 }
 
+static void nl_recv_msg(struct sk_buff *skb)
+{
+    mutex_lock(&nl_mutex);
+    nl_recv_msg_locked(skb);
+    mutex_unlock(&nl_mutex);
+}
+
 static int __init kloadgend_init(void)
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
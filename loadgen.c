@@ -2,52 +2,30 @@
 
 #include <unistd.h>
 #include <getopt.h>
-#include <stdlib.h>
-#include <stdio.h>
 #include <errno.h>
 #include <math.h>
-#include <sys/wait.h>
-#include <sys/prctl.h>
+#include <signal.h>
 #include <sched.h>
 #include <time.h>
 #include <string.h>
-#include <sys/types.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
-#include "cpu_nl.h"
+#include "loadgen.h"
 
 #define CLOCKID            CLOCK_MONOTONIC
 #define TIMER_SIG          SIGALRM
 
-#define err_exit(msg)           \
-        do {                    \
-            perror(msg);        \
-            exit(EXIT_FAILURE); \
-        } while (0)
-
-#define PCT_TO_MSEC(x)     (x * 10)
-#define MSEC_TO_NSEC(x)    (x * 1e6)
-#define NSEC_PER_SEC       1e9
-
 /* The name this program was invoked by. */
 char *progname;
 
 /* Number of present CPUs. */
 int cpus_onln;
 
-/* Vector of system load values. Values are given in percentages: [0-100] */
-struct sys_load {
-    int st;
-    int ut;
-    int mem;
-};
-
 /* Generic structure containing process data */
 struct proc_struct {
     pid_t pid;
 
-    struct cpu_load cpu_load;  /* CPU load for particular process */
     volatile int is_running;   /* Flag indicating whether process is
                                 * running on CPU or sleeping
                                 */
@@ -56,6 +34,25 @@ struct proc_struct {
     int ind;                   /* Index number of process */
 };
 static struct proc_struct proc;
+static pid_t *cpu_pids;
+static int cpu_proc_num;
+
+/* Per-CPU load targets. User loads are shared with the workers, which
+ * pick changes up at the start of their next period; system loads are
+ * passed on to the kernel module.
+ */
+static struct cpu_load *user_loads;
+static struct cpu_load *sys_loads;
+
+/* Wake-up lateness of user load workers */
+static struct lat_hist *cpu_jitter_live;
+static struct lat_hist *cpu_jitter_prev;
+static struct lat_hist *cpu_jitter_last;
+static struct cpu_times *cpu_times_prev;
+
+/* CPU time the user load workers used, their own accounting */
+static unsigned long *cpu_used_ns;
+static unsigned long cpu_used_prev, cpu_used_prev_ns;
 
 /* Structures for communicating with the kernel. */
 static int sock_fd;
@@ -63,11 +60,139 @@ static struct sockaddr_nl src_addr, dest_addr;
 static struct nlmsghdr *nlh, *nlh_ack;
 static struct nl_packet *packet;
 
+volatile sig_atomic_t stop_requested;
+
+static struct sys_load sys_load;
+static int daemon_mode;
+static const char *control_path;    /* NULL: the daemon's default */
+static unsigned int metrics_port;
+static unsigned int controller_port;
+static int controller_agents = 1;
+static unsigned int start_delay_ms = 2000;
+static unsigned int join_timeout_s = 60;
+static const char *agent_addr;
+
+const struct engine *const engines[] = {
+    &kmod_engine,
+    &cpu_engine,
+    &coh_engine,
+    &io_engine,
+    &pc_engine,
+    &sched_engine,
+    &psi_engine,
+    NULL
+};
+static int engine_on[sizeof(engines) / sizeof(engines[0])];
+
+/* Long-only options */
+enum {
+    OPT_COHERENCE = 256,
+    OPT_COH_TOPO,
+    OPT_COH_RATE,
+    OPT_COH_WORKERS,
+    OPT_COH_GROUPS,
+    OPT_IO_FILE,
+    OPT_IO_RW,
+    OPT_IO_ENGINE,
+    OPT_IO_BS,
+    OPT_IO_SIZE,
+    OPT_IO_DEPTH,
+    OPT_IO_JOBS,
+    OPT_IO_DIRECT,
+    OPT_IO_IOPS,
+    OPT_IO_BW,
+    OPT_IO_DUTY,
+    OPT_PC_DIR,
+    OPT_PC_RESIDENT,
+    OPT_PC_SET,
+    OPT_PC_READ,
+    OPT_PC_DIRTY,
+    OPT_PC_DIRTY_SIZE,
+    OPT_IRQ,
+    OPT_SOFTIRQ,
+    OPT_IRQ_RATE,
+    OPT_SOFTIRQ_RATE,
+    OPT_IDLE,
+    OPT_IDLE_PERIOD,
+    OPT_SCHED_TASKS,
+    OPT_SCHED_UTIL,
+    OPT_SCHED_TYPE,
+    OPT_SCHED_WAKE,
+    OPT_SCHED_PERIOD,
+    OPT_SCHED_PIN,
+    OPT_PSI,
+    OPT_PSI_TARGET,
+    OPT_PSI_KIND,
+    OPT_PSI_CGROUP,
+    OPT_PSI_TASKS,
+    OPT_PSI_MEM,
+    OPT_PSI_DIR,
+    OPT_PSI_LOG,
+    OPT_DAEMON,
+    OPT_CONTROL,
+    OPT_METRICS_PORT,
+    OPT_CONTROLLER,
+    OPT_AGENTS,
+    OPT_START_DELAY,
+    OPT_JOIN_TIMEOUT,
+    OPT_AGENT
+};
+
 static struct option longopts[] = {
     {"help", no_argument, NULL, 'h'},
     {"systime", required_argument, NULL, 's'},
     {"usertime", required_argument, NULL, 'u'},
     {"memory", required_argument, NULL, 'm'},
+    {"coherence", required_argument, NULL, OPT_COHERENCE},
+    {"coh-topo", required_argument, NULL, OPT_COH_TOPO},
+    {"coh-rate", required_argument, NULL, OPT_COH_RATE},
+    {"coh-workers", required_argument, NULL, OPT_COH_WORKERS},
+    {"coh-groups", required_argument, NULL, OPT_COH_GROUPS},
+    {"io-file", required_argument, NULL, OPT_IO_FILE},
+    {"io-rw", required_argument, NULL, OPT_IO_RW},
+    {"io-engine", required_argument, NULL, OPT_IO_ENGINE},
+    {"io-bs", required_argument, NULL, OPT_IO_BS},
+    {"io-size", required_argument, NULL, OPT_IO_SIZE},
+    {"io-depth", required_argument, NULL, OPT_IO_DEPTH},
+    {"io-jobs", required_argument, NULL, OPT_IO_JOBS},
+    {"io-direct", no_argument, NULL, OPT_IO_DIRECT},
+    {"io-iops", required_argument, NULL, OPT_IO_IOPS},
+    {"io-bw", required_argument, NULL, OPT_IO_BW},
+    {"io-duty", required_argument, NULL, OPT_IO_DUTY},
+    {"pc-dir", required_argument, NULL, OPT_PC_DIR},
+    {"pc-resident", required_argument, NULL, OPT_PC_RESIDENT},
+    {"pc-set", required_argument, NULL, OPT_PC_SET},
+    {"pc-read", required_argument, NULL, OPT_PC_READ},
+    {"pc-dirty", required_argument, NULL, OPT_PC_DIRTY},
+    {"pc-dirty-size", required_argument, NULL, OPT_PC_DIRTY_SIZE},
+    {"irq", required_argument, NULL, OPT_IRQ},
+    {"softirq", required_argument, NULL, OPT_SOFTIRQ},
+    {"irq-rate", required_argument, NULL, OPT_IRQ_RATE},
+    {"softirq-rate", required_argument, NULL, OPT_SOFTIRQ_RATE},
+    {"idle", required_argument, NULL, OPT_IDLE},
+    {"idle-period", required_argument, NULL, OPT_IDLE_PERIOD},
+    {"sched-tasks", required_argument, NULL, OPT_SCHED_TASKS},
+    {"sched-util", required_argument, NULL, OPT_SCHED_UTIL},
+    {"sched-type", required_argument, NULL, OPT_SCHED_TYPE},
+    {"sched-wake", required_argument, NULL, OPT_SCHED_WAKE},
+    {"sched-period", required_argument, NULL, OPT_SCHED_PERIOD},
+    {"sched-pin", no_argument, NULL, OPT_SCHED_PIN},
+    {"psi", required_argument, NULL, OPT_PSI},
+    {"psi-target", required_argument, NULL, OPT_PSI_TARGET},
+    {"psi-kind", required_argument, NULL, OPT_PSI_KIND},
+    {"psi-cgroup", required_argument, NULL, OPT_PSI_CGROUP},
+    {"psi-tasks", required_argument, NULL, OPT_PSI_TASKS},
+    {"psi-mem", required_argument, NULL, OPT_PSI_MEM},
+    {"psi-dir", required_argument, NULL, OPT_PSI_DIR},
+    {"psi-log", required_argument, NULL, OPT_PSI_LOG},
+    {"daemon", no_argument, NULL, OPT_DAEMON},
+    {"control", required_argument, NULL, OPT_CONTROL},
+    {"metrics-port", required_argument, NULL, OPT_METRICS_PORT},
+    {"controller", required_argument, NULL, OPT_CONTROLLER},
+    {"agents", required_argument, NULL, OPT_AGENTS},
+    {"start-delay", required_argument, NULL, OPT_START_DELAY},
+    {"join-timeout", required_argument, NULL, OPT_JOIN_TIMEOUT},
+    {"agent", required_argument, NULL, OPT_AGENT},
 
     {NULL, no_argument, NULL, 0}
 };
@@ -77,20 +202,78 @@ static void usage(FILE *stream, int status)
     fprintf(stream,
             "Usage: %s [-s systime] [-u usertime] [-r realtime] [-m memory]\n"
             "\t[--systime=systime] [--usertime=usertime] [--memory=memory]\n"
+            "\t[--irq=irqtime] [--softirq=softirqtime] [--irq-rate=hz]\n"
+            "\t[--softirq-rate=hz] [--idle=idletime] [--idle-period=msec]\n"
+            "\t[--coherence=atomic|false|spin|mutex] [--coh-topo=core|llc|cross]\n"
+            "\t[--coh-rate=ops] [--coh-workers=n] [--coh-groups=n]\n"
+            "\t[--io-file=path] [--io-rw=read|write|rw|randread|randwrite|randrw]\n"
+            "\t[--io-engine=uring|psync] [--io-bs=size] [--io-size=size]\n"
+            "\t[--io-depth=n] [--io-jobs=n] [--io-direct] [--io-iops=n]\n"
+            "\t[--io-bw=MB/s] [--io-duty=duty]\n"
+            "\t[--pc-dir=dir] [--pc-resident=size] [--pc-set=size]\n"
+            "\t[--pc-read=MB/s] [--pc-dirty=MB/s] [--pc-dirty-size=size]\n"
+            "\t[--sched-tasks=n] [--sched-util=util]\n"
+            "\t[--sched-type=thread|process|kthread] [--sched-wake=timer|futex|pipe]\n"
+            "\t[--sched-period=msec] [--sched-pin]\n"
+            "\t[--psi=cpu|memory|io] [--psi-target=pct] [--psi-kind=some|full]\n"
+            "\t[--psi-cgroup=dir] [--psi-tasks=n] [--psi-mem=size]\n"
+            "\t[--psi-dir=dir] [--psi-log=file]\n"
+            "\t[--daemon] [--control=path] [--metrics-port=port]\n"
+            "\t[--controller=port] [--agents=n] [--start-delay=msec]\n"
+            "\t[--join-timeout=sec]\n"
+            "\t[--agent=host:port]\n"
             "\t[--help]\n\n"
-            "All the values are given in percentages: [0-100]\n",
-            progname);
+            "CPU and memory values are given in percentages: [0-100]\n"
+            "-s, --irq and --softirq are generated by the %s module;\n"
+            "interrupt time is split into --irq-rate hrtimer interrupts and\n"
+            "--softirq-rate tasklets per second (1000 by default).\n"
+            "--idle forces CPUs idle for a share of every --idle-period\n"
+            "(50 msec by default) instead of adding load, at most 95%%.\n"
+            "--coherence runs groups of pinned workers sharing an atomic\n"
+            "counter, a cache line (false sharing), a spinlock or a mutex;\n"
+            "--coh-rate is the target of operations per second per worker.\n"
+            "Groups don't share CPUs, each needs at least 2 of its own.\n"
+            "--io-file runs the I/O engine against the given file; --io-iops\n"
+            "and --io-bw are totals for all jobs, issued in the first\n"
+            "--io-duty percent of every second.\n"
+            "--pc-dir keeps --pc-resident bytes of files in the page cache,\n"
+            "cycles through a --pc-set file set at --pc-read and dirties\n"
+            "pages at --pc-dirty, reporting /proc/vmstat reclaim and\n"
+            "writeback counters. Sizes take K, M, G suffixes.\n"
+            "--sched-tasks runs that many tasks per CPU, each woken once a\n"
+            "--sched-period (10 msec by default) by its own timer or by a\n"
+            "futex or pipe chain, together keeping CPUs --sched-util busy.\n"
+            "--psi scales runnable tasks and their duty cycle (cpu, io) or\n"
+            "the touched footprint (memory, up to --psi-mem) until the\n"
+            "some or full stall share of the resource holds at --psi-target,\n"
+            "system-wide or in --psi-cgroup, where the load tasks are moved.\n"
+            "System-wide cpu pressure has no full line worth targeting.\n"
+            "--psi-tasks defaults to 4 per CPU; --psi-log records the\n"
+            "trajectory as CSV.\n"
+            "--daemon keeps running and takes commands on the --control\n"
+            "UNIX socket ($XDG_RUNTIME_DIR/loadgen.sock, or else\n"
+            "/tmp/loadgen-$UID/loadgen.sock by default), one per line; send\n"
+            "'help' for the list. --metrics-port serves OpenMetrics over\n"
+            "HTTP on 127.0.0.1.\n"
+            "--controller waits for --agents agents (1 by default), sends\n"
+            "each the -u and -s loads for all of its CPUs and a common start\n"
+            "time --start-delay (2000 msec by default) ahead, then prints\n"
+            "their reports and a summary every second. It gives up if they\n"
+            "have not all joined and synchronised within --join-timeout\n"
+            "(60 sec by default, 0 waits forever). --agent runs the plan of\n"
+            "the controller at host:port, with its own options for the\n"
+            "other engines. All loads start at the agreed time, but only the\n"
+            "-u periods stay aligned to it; agents report the usage of\n"
+            "their own -u and -s loads, not that of the whole host.\n",
+            progname, KMOD_NAME);
     exit(status);
 }
 
 static int trytoconv()
 {
-    static int ret;
-    static char *endptr;
+    int ret;
 
-    endptr = "";
-    ret = strtol(optarg, &endptr, 10);
-    if (endptr[0] != '\0' || ret < 0 || ret > 100) {
+    if (parse_pct(optarg, &ret) < 0) {
         fprintf(stderr, "%s: invalid argument: %s\nLoad value should"
                 "be in range [0-100]\n", progname, optarg);
         exit (EXIT_FAILURE);
@@ -99,8 +282,105 @@ static int trytoconv()
     return ret;
 }
 
+static unsigned long trytoconv_ulong(unsigned long max)
+{
+    unsigned long ret;
+    char *endptr = "";
+
+    errno = 0;
+    ret = strtoul(optarg, &endptr, 10);
+    if (endptr[0] != '\0' || optarg[0] == '-' || errno || ret > max) {
+        fprintf(stderr, "%s: invalid argument: %s\nValue should "
+                "be in range [0-%lu]\n", progname, optarg, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return ret;
+}
+
+static double trytoconv_double(double max)
+{
+    double ret;
+    char *endptr = "";
+
+    errno = 0;
+    ret = strtod(optarg, &endptr);
+    if (endptr[0] != '\0' || errno || !(ret >= 0 && ret <= max)) {
+        fprintf(stderr, "%s: invalid argument: %s\nValue should "
+                "be in range [0-%g]\n", progname, optarg, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return ret;
+}
+
+/* Size in bytes with an optional K, M or G suffix */
+static unsigned long trytoconv_size(void)
+{
+    unsigned long ret;
+
+    if (parse_size(optarg, &ret) < 0) {
+        fprintf(stderr, "%s: invalid size: %s\n", progname, optarg);
+        exit(EXIT_FAILURE);
+    }
+
+    return ret;
+}
+
+/* Map optarg to the index of a matching name in names[] */
+static int trytomatch(const char *const names[], int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (names[i] && strcmp(optarg, names[i]) == 0)
+            return i;
+
+    fprintf(stderr, "%s: invalid argument: %s\n", progname, optarg);
+    exit(EXIT_FAILURE);
+}
+
 static void getargs(int argc, char *argv[], struct sys_load *sys_load)
 {
+    static const char *const coh_modes[] = {
+        [COH_ATOMIC] = "atomic",
+        [COH_FALSE] = "false",
+        [COH_SPIN] = "spin",
+        [COH_MUTEX] = "mutex",
+    };
+    static const char *const coh_topos[] = {
+        [COH_TOPO_CORE] = "core",
+        [COH_TOPO_LLC] = "llc",
+        [COH_TOPO_CROSS] = "cross",
+    };
+    static const char *const io_rws[] = {
+        [IO_READ] = "read",
+        [IO_WRITE] = "write",
+        [IO_RW] = "rw",
+        [IO_RANDREAD] = "randread",
+        [IO_RANDWRITE] = "randwrite",
+        [IO_RANDRW] = "randrw",
+    };
+    static const char *const sched_types[] = {
+        [SCHED_TYPE_THREAD] = "thread",
+        [SCHED_TYPE_PROCESS] = "process",
+        [SCHED_TYPE_KTHREAD] = "kthread",
+    };
+    static const char *const sched_wakes[] = {
+        [SCHED_WAKE_TIMER] = "timer",
+        [SCHED_WAKE_FUTEX] = "futex",
+        [SCHED_WAKE_PIPE] = "pipe",
+    };
+    static const char *const psi_resources[] = {
+        [PSI_CPU] = "cpu",
+        [PSI_MEMORY] = "memory",
+        [PSI_IO] = "io",
+    };
+    static const char *const psi_kinds[] = {"some", "full"};
+    static const char *const io_engines[] = {
+        [IO_ENGINE_URING] = "uring",
+        [IO_ENGINE_PSYNC] = "psync",
+    };
     int opt;
 
     progname = basename(argv[0]);
@@ -119,6 +399,156 @@ static void getargs(int argc, char *argv[], struct sys_load *sys_load)
         case 'm':
             sys_load->mem = trytoconv();
             break;
+        case OPT_COHERENCE:
+            sys_load->coh.mode = trytomatch(coh_modes, 5);
+            break;
+        case OPT_COH_TOPO:
+            sys_load->coh.topo = trytomatch(coh_topos, 3);
+            break;
+        case OPT_COH_RATE:
+            sys_load->coh.rate = trytoconv_ulong(1000000000);
+            break;
+        case OPT_COH_WORKERS:
+            sys_load->coh.workers = trytoconv_ulong(64);
+            break;
+        case OPT_COH_GROUPS:
+            sys_load->coh.groups = trytoconv_ulong(1024);
+            break;
+        case OPT_IO_FILE:
+            sys_load->io.file = optarg;
+            break;
+        case OPT_IO_RW:
+            sys_load->io.rw = trytomatch(io_rws, 6);
+            break;
+        case OPT_IO_ENGINE:
+            sys_load->io.engine = trytomatch(io_engines, 2);
+            break;
+        case OPT_IO_BS:
+            sys_load->io.bs = trytoconv_size();
+            break;
+        case OPT_IO_SIZE:
+            sys_load->io.size = trytoconv_size();
+            break;
+        case OPT_IO_DEPTH:
+            sys_load->io.depth = trytoconv_ulong(1024);
+            break;
+        case OPT_IO_JOBS:
+            sys_load->io.jobs = trytoconv_ulong(1024);
+            break;
+        case OPT_IO_DIRECT:
+            sys_load->io.direct = 1;
+            break;
+        case OPT_IO_IOPS:
+            sys_load->io.iops = trytoconv_ulong(100000000);
+            break;
+        case OPT_IO_BW:
+            sys_load->io.bw = trytoconv_ulong(1000000) * 1000000;
+            break;
+        case OPT_IO_DUTY:
+            sys_load->io.duty = trytoconv();
+            break;
+        case OPT_IRQ:
+            sys_load->irq = trytoconv();
+            break;
+        case OPT_SOFTIRQ:
+            sys_load->softirq = trytoconv();
+            break;
+        case OPT_IRQ_RATE:
+            sys_load->irq_hz = trytoconv_ulong(100000);
+            break;
+        case OPT_SOFTIRQ_RATE:
+            sys_load->softirq_hz = trytoconv_ulong(100000);
+            break;
+        case OPT_IDLE:
+            sys_load->idle = trytoconv();
+            break;
+        case OPT_IDLE_PERIOD:
+            sys_load->idle_period_ms = trytoconv_ulong(1000);
+            break;
+        case OPT_SCHED_TASKS:
+            sys_load->sched.tasks = trytoconv_ulong(100000);
+            break;
+        case OPT_SCHED_UTIL:
+            sys_load->sched.util = trytoconv();
+            break;
+        case OPT_SCHED_TYPE:
+            sys_load->sched.type = trytomatch(sched_types, 3);
+            break;
+        case OPT_SCHED_WAKE:
+            sys_load->sched.wake = trytomatch(sched_wakes, 3);
+            break;
+        case OPT_SCHED_PERIOD:
+            sys_load->sched.period_ms = trytoconv_ulong(1000);
+            break;
+        case OPT_SCHED_PIN:
+            sys_load->sched.pin = 1;
+            break;
+        case OPT_PSI:
+            sys_load->psi.res = trytomatch(psi_resources, 4);
+            break;
+        case OPT_PSI_TARGET:
+            sys_load->psi.target = trytoconv_double(100);
+            break;
+        case OPT_PSI_KIND:
+            sys_load->psi.full = trytomatch(psi_kinds, 2);
+            break;
+        case OPT_PSI_CGROUP:
+            sys_load->psi.cgroup = optarg;
+            break;
+        case OPT_PSI_TASKS:
+            sys_load->psi.max_tasks = trytoconv_ulong(100000);
+            break;
+        case OPT_PSI_MEM:
+            sys_load->psi.mem_max = trytoconv_size();
+            break;
+        case OPT_PSI_DIR:
+            sys_load->psi.dir = optarg;
+            break;
+        case OPT_PSI_LOG:
+            sys_load->psi.log = optarg;
+            break;
+        case OPT_DAEMON:
+            daemon_mode = 1;
+            break;
+        case OPT_CONTROL:
+            control_path = optarg;
+            break;
+        case OPT_METRICS_PORT:
+            metrics_port = trytoconv_ulong(65535);
+            break;
+        case OPT_CONTROLLER:
+            controller_port = trytoconv_ulong(65535);
+            break;
+        case OPT_AGENTS:
+            controller_agents = trytoconv_ulong(1024);
+            break;
+        case OPT_START_DELAY:
+            start_delay_ms = trytoconv_ulong(3600000);
+            break;
+        case OPT_JOIN_TIMEOUT:
+            join_timeout_s = trytoconv_ulong(86400);
+            break;
+        case OPT_AGENT:
+            agent_addr = optarg;
+            break;
+        case OPT_PC_DIR:
+            sys_load->pc.dir = optarg;
+            break;
+        case OPT_PC_RESIDENT:
+            sys_load->pc.resident = trytoconv_size();
+            break;
+        case OPT_PC_SET:
+            sys_load->pc.set = trytoconv_size();
+            break;
+        case OPT_PC_READ:
+            sys_load->pc.read_rate = trytoconv_ulong(1000000) * 1000000;
+            break;
+        case OPT_PC_DIRTY:
+            sys_load->pc.dirty_rate = trytoconv_ulong(1000000) * 1000000;
+            break;
+        case OPT_PC_DIRTY_SIZE:
+            sys_load->pc.dirty_size = trytoconv_size();
+            break;
         case 'h':
             usage(stdout, EXIT_SUCCESS);
         case 1:
@@ -129,6 +559,73 @@ static void getargs(int argc, char *argv[], struct sys_load *sys_load)
             usage(stderr, EXIT_FAILURE);
         }
     }
+
+    if (!sys_load->irq_hz)
+        sys_load->irq_hz = 1000;
+    if (!sys_load->softirq_hz)
+        sys_load->softirq_hz = 1000;
+    if (!sys_load->idle_period_ms)
+        sys_load->idle_period_ms = 50;
+    if (!sys_load->sched.period_ms)
+        sys_load->sched.period_ms = 10;
+    if (sys_load->sched.type == SCHED_TYPE_KTHREAD &&
+        sys_load->sched.wake != SCHED_WAKE_TIMER) {
+        fprintf(stderr, "%s: kthreads are only woken by timers\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (sys_load->sched.type == SCHED_TYPE_KTHREAD &&
+        (unsigned long) sys_load->sched.tasks * cpus_onln >
+        SCHED_KTHREAD_MAX) {
+        fprintf(stderr, "%s: at most %d kthreads on all %d CPUs\n",
+                progname, SCHED_KTHREAD_MAX, cpus_onln);
+        exit(EXIT_FAILURE);
+    }
+    if (sys_load->sched.tasks && sys_load->sched.util &&
+        (unsigned long) sys_load->sched.period_ms * 10000 *
+        sys_load->sched.util / sys_load->sched.tasks < SCHED_MIN_WORK_NS) {
+        fprintf(stderr, "%s: %u tasks at %d%% of %u ms run under %d ns "
+                "each, use fewer tasks or a longer --sched-period\n",
+                progname, sys_load->sched.tasks, sys_load->sched.util,
+                sys_load->sched.period_ms, SCHED_MIN_WORK_NS);
+        exit(EXIT_FAILURE);
+    }
+    if ((controller_port != 0) + (agent_addr != NULL) + daemon_mode > 1) {
+        fprintf(stderr, "%s: --controller, --agent and --daemon are "
+                "exclusive\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (controller_port && !controller_agents) {
+        fprintf(stderr, "%s: --agents should be at least 1\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (sys_load->psi.res != PSI_NONE && !(sys_load->psi.target > 0)) {
+        fprintf(stderr, "%s: --psi needs a --psi-target above 0\n",
+                progname);
+        exit(EXIT_FAILURE);
+    }
+    /* The kernel reports system-wide cpu full as 0, if at all */
+    if (sys_load->psi.res == PSI_CPU && sys_load->psi.full &&
+        !sys_load->psi.cgroup) {
+        fprintf(stderr, "%s: --psi=cpu --psi-kind=full needs a "
+                "--psi-cgroup\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (sys_load->idle > 95) {
+        fprintf(stderr, "%s: idle injection may not exceed 95%%\n",
+                progname);
+        exit(EXIT_FAILURE);
+    }
+    if (sys_load->irq + sys_load->softirq > 90) {
+        fprintf(stderr, "%s: irq and softirq load together may not "
+                "exceed 90%%\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (sys_load->st + sys_load->irq + sys_load->softirq +
+        sys_load->idle > 100) {
+        fprintf(stderr, "%s: system, irq, softirq and idle time together "
+                "exceed 100%%\n", progname);
+        exit(EXIT_FAILURE);
+    }
 }
 
 static void proc_state_swith(int sig)
@@ -139,24 +636,23 @@ static void proc_state_swith(int sig)
     return;
 }
 
-static void cpu_proc_func(void)
+static unsigned long proc_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void cpu_proc_func(void *arg)
 {
-    cpu_set_t set;
     struct sigevent sev;
     struct sigaction sa;
     timer_t timerid;
     struct itimerspec work_its;
-    struct timespec    sleep_ts, delay;
-
-    /* Make sure children are dead after parent's death */
-    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
-        err_exit("prctl");
+    unsigned long next, load_msec, used;
 
-    /* Set process CPU afffinity */
-    CPU_ZERO(&set);
-    CPU_SET(proc.cpu_load.cpu_num, &set);
-    if (sched_setaffinity(0, sizeof(set), &set) < 0)
-        err_exit("sched_setaffinity");
+    /* Process CPU affinity is set by spawn_worker() */
 
     /* Establish handler for timer signal */
     sa.sa_handler = proc_state_swith;
@@ -171,50 +667,41 @@ static void cpu_proc_func(void)
     if (timer_create(CLOCKID, &sev, &timerid) < 0)
         err_exit("timer_create");
 
-    /* Set process work and sleep times */
-
     /* We don't want it to be periodic */
     work_its.it_interval.tv_sec = 0;
     work_its.it_interval.tv_nsec = 0;
 
-    /* Set one-time expiration value; timer is re-armed with those
-     * values by signal handler.
-     */
-    work_its.it_value.tv_sec = 0;
-    work_its.it_value.tv_nsec = MSEC_TO_NSEC(proc.cpu_load.load_msec);
-
-    /* Set sleep time */
-    sleep_ts.tv_sec = 0;
-    sleep_ts.tv_nsec = NSEC_PER_SEC - work_its.it_value.tv_nsec;
-
     /* Distribute timer events evenly
      *
      *  0       1/3        2/3        1s
      *  |--------*----------*---------|
      * proc1   proc2      proc3    proc1
      */
-
-    /* 1 second alignment */
-    clock_gettime(CLOCKID, &delay);
-    delay.tv_sec++;
-    delay.tv_nsec = 0;
-    clock_nanosleep(CLOCKID, TIMER_ABSTIME, &delay, NULL);
-
-    delay.tv_sec = 0;
-    delay.tv_nsec = (NSEC_PER_SEC / proc.proc_num) * proc.ind;
-    clock_nanosleep(CLOCKID, 0, &delay, NULL);
-
-    proc.is_running = 1;
+    next = period_start_ns(proc.ind, proc.proc_num);
     while (1) {
-        timer_settime(timerid, 0, &work_its, NULL);
-        while (proc.is_running)
-            sqrt(rand());
-        clock_nanosleep(CLOCKID, 0, &sleep_ts, NULL);
-        proc.is_running = 1;
+        sleep_until_ns(next);
+        lat_hist_add(&cpu_jitter_live[proc.ind], now_ns() - next);
+
+        /* Work time may be changed at run time, see set_cpu_load() */
+        load_msec = __atomic_load_n(&user_loads[proc.ind].load_msec,
+                                    __ATOMIC_RELAXED);
+        if (load_msec) {
+            work_its.it_value.tv_sec = load_msec / 1000;
+            work_its.it_value.tv_nsec = MSEC_TO_NSEC(load_msec % 1000);
+            proc.is_running = 1;
+            timer_settime(timerid, 0, &work_its, NULL);
+            used = proc_cpu_ns();
+            while (proc.is_running)
+                sqrt(rand());
+            __atomic_fetch_add(&cpu_used_ns[proc.ind], proc_cpu_ns() - used,
+                               __ATOMIC_RELAXED);
+        }
+        next += NSEC_PER_SEC;
     }
 }
 
-static void process_ack(void)
+/* Returns the negative errno the module rejected the request with */
+static int process_ack(void)
 {
     if (nlh->nlmsg_seq != nlh_ack->nlmsg_seq) {
         fprintf(stderr, "Nlmsg sequence number mismatch: %d instead of "
@@ -228,89 +715,179 @@ static void process_ack(void)
     else {
         struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(nlh_ack);
         if (err->error != 0) {
-            fprintf(stderr, "Nlmsg error == %d instead of %d\n",
-                    err->error, 0);
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "%s: %s rejected the request: %s\n", progname,
+                    KMOD_NAME, strerror(-err->error));
+            return err->error;
         }
     }
 
-    return;
+    return 0;
 }
 
-static void send_to_kernel(int cpus_onln, const struct sys_load *sys_load)
+/* Send the prepared packet and wait for its acknowledgement */
+static int nl_send_packet(void)
 {
-    int i;
-
-    /* Send number of threads to kernel */
-    packet->packet_type = NL_INIT;
-    nlh->nlmsg_seq = 0;
-    if (sendto(sock_fd, (void *) nlh, nlh->nlmsg_len, 0, (struct sockaddr *)
-               &dest_addr, sizeof(struct sockaddr_nl)) < 0)
+    if (sendto(sock_fd, (void *) nlh, nlh->nlmsg_len, 0,
+               (struct sockaddr *) &dest_addr,
+               sizeof(struct sockaddr_nl)) < 0)
         err_exit("sendto");
 
-    /* Now try to receive acknowledgement */
     if (recv(sock_fd, (void *) nlh_ack,
              NLMSG_LENGTH(sizeof(struct nlmsgerr)), 0) < 0)
         err_exit("recv");
-    process_ack();
-
-    /* Send all CPU loads to kernel */
-    for (i = 0; i < cpus_onln; i++) {
-        packet->packet_type = NL_CPU_LOAD;
-        packet->cpu_load.cpu_num = i;
-        packet->cpu_load.load_msec = PCT_TO_MSEC(sys_load->st);
+    return process_ack();
+}
 
-        nlh->nlmsg_seq++;
-        if (sendto(sock_fd, (void *) nlh, nlh->nlmsg_len, 0,
-                   (struct sockaddr *) &dest_addr,
-                   sizeof(struct sockaddr_nl)) < 0)
-            err_exit("sendto");
+/* Ask the module for statistics, NL_IDLE_STATS or NL_CPU_STATS of a
+ * CPU, which *stats is replaced with. The data comes in a separate
+ * message before the acknowledgement.
+ */
+static int nl_get_stats(struct nl_packet *stats)
+{
+    static struct nlmsghdr *nlh_data;
 
-        if (recv(sock_fd, (void *) nlh_ack,
-                 NLMSG_LENGTH(sizeof(struct nlmsgerr)), 0) < 0)
-            err_exit("recv");
-        process_ack();
+    if (!nlh_data) {
+        nlh_data = malloc(NLMSG_SPACE(sizeof(struct nl_packet)));
+        if (!nlh_data)
+            err_exit("malloc");
     }
 
-    /* Tell kernel module to run kthreads. */
-    packet->packet_type = NL_RUN_THREADS;
+    *packet = *stats;
     nlh->nlmsg_seq++;
     if (sendto(sock_fd, (void *) nlh, nlh->nlmsg_len, 0,
                (struct sockaddr *) &dest_addr,
                sizeof(struct sockaddr_nl)) < 0)
         err_exit("sendto");
 
+    if (recv(sock_fd, (void *) nlh_data,
+             NLMSG_SPACE(sizeof(struct nl_packet)), 0) < 0)
+        err_exit("recv");
+    /* A rejected request is only acknowledged */
+    if (nlh_data->nlmsg_type == NLMSG_ERROR) {
+        memcpy(nlh_ack, nlh_data, NLMSG_LENGTH(sizeof(struct nlmsgerr)));
+        return process_ack();
+    }
+    if (nlh_data->nlmsg_type != NLMSG_CPUHOG_DATA ||
+        nlh_data->nlmsg_seq != nlh->nlmsg_seq) {
+        fprintf(stderr, "Unexpected nlmsg of type %d, sequence number %d\n",
+                nlh_data->nlmsg_type, nlh_data->nlmsg_seq);
+        exit(EXIT_FAILURE);
+    }
+    *stats = *(struct nl_packet *) NLMSG_DATA(nlh_data);
+
     if (recv(sock_fd, (void *) nlh_ack,
              NLMSG_LENGTH(sizeof(struct nlmsgerr)), 0) < 0)
         err_exit("recv");
-    process_ack();
+    return process_ack();
+}
+
+static int kmod_sched(const struct sys_load *sys_load)
+{
+    return sys_load->sched.tasks && sys_load->sched.type == SCHED_TYPE_KTHREAD;
+}
+
+static int nl_send_cpu_load(int cpu)
+{
+    packet->packet_type = NL_CPU_LOAD;
+    packet->cpu_load = sys_loads[cpu];
+
+    nlh->nlmsg_seq++;
+    return nl_send_packet();
 }
 
-static void check_kmod_is_loaded(void)
+/* Returns the first error the module reports */
+static int send_to_kernel(int cpus_onln, const struct sys_load *sys_load)
+{
+    int i, ret;
+
+    /* Send number of threads to kernel */
+    packet->packet_type = NL_INIT;
+    nlh->nlmsg_seq = 0;
+    if ((ret = nl_send_packet()) < 0)
+        return ret;
+
+    /* Send all CPU loads to kernel */
+    for (i = 0; i < cpus_onln; i++)
+        if (sys_loads[i].load_msec && (ret = nl_send_cpu_load(i)) < 0)
+            return ret;
+
+    /* Interrupt loads: spread the time over irq_hz events a second */
+    for (i = 0; i < cpus_onln && (sys_load->irq || sys_load->softirq); i++) {
+        packet->packet_type = NL_IRQ_LOAD;
+        packet->irq_load.cpu_num = i;
+        packet->irq_load.hardirq_hz = sys_load->irq ? sys_load->irq_hz : 0;
+        packet->irq_load.hardirq_ns = sys_load->irq ?
+            PCT_TO_NSEC(sys_load->irq) / sys_load->irq_hz : 0;
+        packet->irq_load.softirq_hz =
+            sys_load->softirq ? sys_load->softirq_hz : 0;
+        packet->irq_load.softirq_ns = sys_load->softirq ?
+            PCT_TO_NSEC(sys_load->softirq) / sys_load->softirq_hz : 0;
+
+        nlh->nlmsg_seq++;
+        if ((ret = nl_send_packet()) < 0)
+            return ret;
+    }
+
+    /* Idle injection */
+    for (i = 0; i < cpus_onln && sys_load->idle; i++) {
+        packet->packet_type = NL_IDLE_LOAD;
+        packet->idle_load.cpu_num = i;
+        packet->idle_load.idle_pct = sys_load->idle;
+        packet->idle_load.period_ms = sys_load->idle_period_ms;
+
+        nlh->nlmsg_seq++;
+        if ((ret = nl_send_packet()) < 0)
+            return ret;
+    }
+
+    /* Scheduler stress kthreads */
+    for (i = 0; i < cpus_onln && kmod_sched(sys_load); i++) {
+        packet->packet_type = NL_SCHED_LOAD;
+        packet->sched_load.cpu_num = i;
+        packet->sched_load.nr_tasks = sys_load->sched.tasks;
+        packet->sched_load.period_us = sys_load->sched.period_ms * 1000;
+        packet->sched_load.work_ns = (unsigned long)
+            sys_load->sched.period_ms * 10000 * sys_load->sched.util /
+            sys_load->sched.tasks;
+        packet->sched_load.pin = sys_load->sched.pin;
+
+        nlh->nlmsg_seq++;
+        if ((ret = nl_send_packet()) < 0)
+            return ret;
+    }
+
+    /* Tell kernel module to run kthreads. */
+    packet->packet_type = NL_RUN_THREADS;
+    nlh->nlmsg_seq++;
+    return nl_send_packet();
+}
+
+static int kmod_is_loaded(void)
 {
     FILE *modf = fopen("/proc/modules", "r");
     char modname[32];
+    int found = 0;
 
-    while (!feof(modf)) {
-        fscanf(modf, "%s%*[^\n]", modname);
+    while (modf && fscanf(modf, "%31s%*[^\n]", modname) == 1) {
         if (strcmp(modname, KMOD_NAME) == 0) {
-            return;
+            found = 1;
+            break;
         }
     }
+    if (modf)
+        fclose(modf);
 
-    fprintf(stderr, "Module %s is not loaded.\nTerminating.\n", KMOD_NAME);
-    exit(EXIT_FAILURE);
+    return found;
 }
 
-static void __attribute__((constructor)) nl_init(void)
+static int nl_init(void)
 {
-    check_kmod_is_loaded();
-    cpus_onln = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret;
 
     /* Use netlink sockets to communicate with kernel module.*/
     sock_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_CPUHOG);
     if (sock_fd < 0)
-        err_exit("socket");
+        return err_ret("socket");
 
     /*
      * struct sockaddr_nl {
@@ -322,8 +899,11 @@ static void __attribute__((constructor)) nl_init(void)
      */
     dest_addr = (struct sockaddr_nl) { AF_NETLINK, 0, 0, 0 };
     src_addr = (struct sockaddr_nl) { AF_NETLINK, 0, getpid(), 0 };
-    if (bind(sock_fd, (struct sockaddr *) &src_addr, sizeof(src_addr)) < 0)
-        err_exit("bind");
+    if (bind(sock_fd, (struct sockaddr *) &src_addr, sizeof(src_addr)) < 0) {
+        ret = err_ret("bind");
+        close(sock_fd);
+        return ret;
+    }
 
     nlh = (struct nlmsghdr *) malloc(NLMSG_SPACE(sizeof(struct nl_packet)));
     nlh_ack = (struct nlmsghdr *) malloc(NLMSG_SPACE(sizeof(struct nlmsgerr)));
@@ -336,9 +916,10 @@ static void __attribute__((constructor)) nl_init(void)
     nlh->nlmsg_pid   = getpid();
 
     packet = (struct nl_packet *) NLMSG_DATA(nlh);
+    return 0;
 }
 
-static void __attribute__((destructor)) nl_fini(void)
+static void nl_fini(void)
 {
     /* Tell kernel module to stop kthreads. */
     packet->packet_type = NL_STOP_THREADS;
@@ -355,30 +936,492 @@ static void __attribute__((destructor)) nl_fini(void)
     close(sock_fd);
 }
 
-int main(int argc, char *argv[])
+static struct sys_load kmod_load;
+static struct cpu_times *kmod_times;
+static struct idle_stats *kmod_idle;
+static struct cpu_stats *kmod_hog;
+
+static int any_cpu_load(const struct cpu_load *loads)
 {
     int i;
-    int proc_num;
-    struct sys_load sys_load = {0};
 
-    getargs(argc, argv, &sys_load);
-    proc_num = cpus_onln;
-    send_to_kernel(cpus_onln, &sys_load);
-    pause();
+    for (i = 0; i < cpus_onln; i++)
+        if (loads[i].load_msec)
+            return 1;
+    return 0;
+}
+
+static int kmod_enabled(const struct sys_load *sys_load)
+{
+    return any_cpu_load(sys_loads) || sys_load->irq > 0 ||
+           sys_load->softirq > 0 || sys_load->idle > 0 ||
+           kmod_sched(sys_load);
+}
+
+static void kmod_stop(void);
+
+static int kmod_start(const struct sys_load *sys_load)
+{
+    int ret;
 
-    for (i = 0; i < proc_num; i++) {
-        proc.proc_num = proc_num;
+    if (!kmod_is_loaded()) {
+        fprintf(stderr, "%s: module %s is not loaded\n", progname, KMOD_NAME);
+        return -ENODEV;
+    }
+
+    kmod_load = *sys_load;
+    kmod_times = calloc(cpus_onln, sizeof(struct cpu_times));
+    kmod_idle = calloc(cpus_onln, sizeof(struct idle_stats));
+    kmod_hog = calloc(cpus_onln, sizeof(struct cpu_stats));
+    if (!kmod_times || !kmod_idle || !kmod_hog)
+        err_exit("calloc");
+    read_cpu_times(kmod_times, cpus_onln);
+
+    ret = nl_init();
+    if (ret < 0) {
+        free(kmod_times);
+        free(kmod_idle);
+        free(kmod_hog);
+        kmod_hog = NULL;
+        return ret;
+    }
+    /* Whatever the module took is reset by NL_STOP_THREADS */
+    ret = send_to_kernel(cpus_onln, sys_load);
+    if (ret < 0)
+        kmod_stop();
+    return ret;
+}
+
+static void kmod_stop(void)
+{
+    nl_fini();
+    free(kmod_times);
+    free(kmod_idle);
+    free(kmod_hog);
+    kmod_hog = NULL;
+}
+
+/* System load of the hog threads by their own accounting, averaged
+ * over all CPUs: unlike /proc/stat, it leaves out everybody else.
+ */
+static double kmod_sys_usage(void)
+{
+    struct nl_packet stats;
+    double elapsed, busy = 0;
+    int i;
+
+    if (!kmod_hog)
+        return 0;
+
+    for (i = 0; i < cpus_onln; i++) {
+        if (!sys_loads[i].load_msec)
+            continue;
+        stats.packet_type = NL_CPU_STATS;
+        stats.cpu_stats.cpu_num = i;
+        if (nl_get_stats(&stats) < 0)
+            continue;
+        /* The thread was restarted */
+        if (stats.cpu_stats.elapsed_ns < kmod_hog[i].elapsed_ns)
+            memset(&kmod_hog[i], 0, sizeof(kmod_hog[i]));
+        elapsed = stats.cpu_stats.elapsed_ns - kmod_hog[i].elapsed_ns;
+        if (elapsed > 0)
+            busy += (stats.cpu_stats.busy_ns - kmod_hog[i].busy_ns) * 100 /
+                    elapsed;
+        kmod_hog[i] = stats.cpu_stats;
+    }
+
+    return busy / cpus_onln;
+}
+
+/* Achieved per-CPU system, hardirq, softirq and injected idle time
+ * against targets, in brackets.
+ */
+static void kmod_report(FILE *stream, double interval)
+{
+    struct cpu_times *cur;
+    struct nl_packet stats;
+    struct idle_stats *idle = &stats.idle_stats;
+    double total, elapsed;
+    int i;
+
+    /* Scheduler stress kthreads are reported by the sched engine */
+    if (!any_cpu_load(sys_loads) && !kmod_load.irq && !kmod_load.softirq &&
+        !kmod_load.idle)
+        return;
+
+    cur = calloc(cpus_onln, sizeof(struct cpu_times));
+    if (!cur)
+        err_exit("calloc");
+    read_cpu_times(cur, cpus_onln);
+
+    for (i = 0; i < cpus_onln; i++) {
+        total = cpu_times_total(&cur[i]) - cpu_times_total(&kmod_times[i]);
+        if (total <= 0)
+            continue;
+        fprintf(stream, "kmod cpu%d:", i);
+        if (sys_loads[i].load_msec)
+            fprintf(stream, " sys %.1f%% (%u)",
+                    (cur[i].system - kmod_times[i].system) * 100 / total,
+                    sys_loads[i].load_msec / 10);
+        if (kmod_load.irq)
+            fprintf(stream, " irq %.1f%% (%d)",
+                    (cur[i].irq - kmod_times[i].irq) * 100 / total,
+                    kmod_load.irq);
+        if (kmod_load.softirq)
+            fprintf(stream, " softirq %.1f%% (%d)",
+                    (cur[i].softirq - kmod_times[i].softirq) * 100 / total,
+                    kmod_load.softirq);
+        stats.packet_type = NL_IDLE_STATS;
+        idle->cpu_num = i;
+        if (kmod_load.idle && nl_get_stats(&stats) == 0) {
+            elapsed = idle->elapsed_ns - kmod_idle[i].elapsed_ns;
+            fprintf(stream, " injected idle %.1f%% (%d)", elapsed > 0 ?
+                    (idle->injected_ns - kmod_idle[i].injected_ns) * 100 /
+                    elapsed : 0, kmod_load.idle);
+            kmod_idle[i] = *idle;
+        }
+        fprintf(stream, "\n");
+    }
+
+    free(kmod_times);
+    kmod_times = cur;
+}
+
+const struct engine kmod_engine = {
+    .name = "kmod",
+    .enabled = kmod_enabled,
+    .start = kmod_start,
+    .stop = kmod_stop,
+    .report = kmod_report,
+};
+
+static int cpu_enabled(const struct sys_load *sys_load)
+{
+    return any_cpu_load(user_loads);
+}
+
+static int cpu_start(const struct sys_load *sys_load)
+{
+    int i;
+
+    cpu_proc_num = cpus_onln;
+    cpu_pids = calloc(cpu_proc_num, sizeof(pid_t));
+    cpu_jitter_prev = calloc(cpu_proc_num, sizeof(struct lat_hist));
+    cpu_jitter_last = calloc(cpu_proc_num, sizeof(struct lat_hist));
+    cpu_times_prev = calloc(cpu_proc_num, sizeof(struct cpu_times));
+    if (!cpu_pids || !cpu_jitter_prev || !cpu_jitter_last || !cpu_times_prev)
+        err_exit("calloc");
+    cpu_jitter_live = shared_alloc(cpu_proc_num * sizeof(struct lat_hist));
+    cpu_used_ns = shared_alloc(cpu_proc_num * sizeof(unsigned long));
+    cpu_used_prev = 0;
+    cpu_used_prev_ns = now_ns();
+    read_cpu_times(cpu_times_prev, cpu_proc_num);
+
+    for (i = 0; i < cpu_proc_num; i++) {
+        proc.proc_num = cpu_proc_num;
         proc.ind = i;
-        proc.cpu_load.cpu_num = i;
-        proc.cpu_load.load_msec = PCT_TO_MSEC(sys_load.ut);
 
-        proc.pid = fork();
-        if (!proc.pid)
-            cpu_proc_func();
+        proc.pid = spawn_worker(cpu_proc_func, NULL, i);
+        cpu_pids[i] = proc.pid;
+    }
+    return 0;
+}
+
+static void cpu_stop(void)
+{
+    kill_workers(cpu_pids, cpu_proc_num);
+    free(cpu_pids);
+    cpu_pids = NULL;
+    shared_free(cpu_jitter_live, cpu_proc_num * sizeof(struct lat_hist));
+    shared_free(cpu_used_ns, cpu_proc_num * sizeof(unsigned long));
+    cpu_used_ns = NULL;
+    free(cpu_jitter_prev);
+    free(cpu_jitter_last);
+    free(cpu_times_prev);
+}
+
+/* Achieved per-CPU user time against targets, in brackets, and how
+ * late the workers wake up for their periods.
+ */
+static void cpu_report(FILE *stream, double interval)
+{
+    struct cpu_times *cur;
+    struct lat_hist *lat;
+    double total;
+    int i;
+
+    cur = calloc(cpu_proc_num, sizeof(struct cpu_times));
+    if (!cur)
+        err_exit("calloc");
+    read_cpu_times(cur, cpu_proc_num);
+
+    for (i = 0; i < cpu_proc_num; i++) {
+        lat = &cpu_jitter_last[i];
+        lat_hist_snap(lat, &cpu_jitter_live[i], &cpu_jitter_prev[i]);
+        total = cpu_times_total(&cur[i]) - cpu_times_total(&cpu_times_prev[i]);
+        if (total <= 0)
+            continue;
+        fprintf(stream, "cpu cpu%d: user %.1f%% (%u) jitter us p50 %.1f "
+                "p99 %.1f max %.1f\n", i,
+                (cur[i].user + cur[i].nice - cpu_times_prev[i].user -
+                 cpu_times_prev[i].nice) * 100 / total,
+                user_loads[i].load_msec / 10, lat_hist_pct(lat, 50) / 1e3,
+                lat_hist_pct(lat, 99) / 1e3, lat->max / 1e3);
     }
 
-    for (i = 0; i < proc_num; i++)
-        wait(NULL);
+    free(cpu_times_prev);
+    cpu_times_prev = cur;
+}
 
+/* User load of the workers since the last call by their own
+ * accounting, averaged over all CPUs.
+ */
+static double cpu_user_usage(void)
+{
+    unsigned long used = 0, now = now_ns();
+    double usage;
+    int i;
+
+    if (!cpu_used_ns || now <= cpu_used_prev_ns)
+        return 0;
+
+    for (i = 0; i < cpu_proc_num; i++)
+        used += __atomic_load_n(&cpu_used_ns[i], __ATOMIC_RELAXED);
+    usage = (used - cpu_used_prev) * 100.0 / (now - cpu_used_prev_ns) /
+            cpu_proc_num;
+    cpu_used_prev = used;
+    cpu_used_prev_ns = now;
+    return usage;
+}
+
+const struct engine cpu_engine = {
+    .name = "cpu",
+    .enabled = cpu_enabled,
+    .start = cpu_start,
+    .stop = cpu_stop,
+    .report = cpu_report,
+};
+
+static int engine_index(const struct engine *e)
+{
+    int i;
+
+    for (i = 0; engines[i]; i++)
+        if (engines[i] == e)
+            return i;
+    return -1;
+}
+
+int engine_enabled(const struct engine *e)
+{
+    return e->enabled(&sys_load);
+}
+
+int engine_running(const struct engine *e)
+{
+    return engine_on[engine_index(e)];
+}
+
+int engine_start(const struct engine *e)
+{
+    int i = engine_index(e), ret;
+
+    if (engine_on[i])
+        return -EALREADY;
+    if (!e->enabled(&sys_load))
+        return -EINVAL;
+    ret = e->start(&sys_load);
+    if (ret < 0)
+        return ret;
+    engine_on[i] = 1;
+    return 0;
+}
+
+int engine_stop(const struct engine *e)
+{
+    int i = engine_index(e);
+
+    if (!engine_on[i])
+        return -ESRCH;
+    e->stop();
+    engine_on[i] = 0;
+    return 0;
+}
+
+int get_cpu_load(int cpu, int sys)
+{
+    return (sys ? sys_loads : user_loads)[cpu].load_msec / 10;
+}
+
+/* Change the user or system load target of a CPU at run time. User
+ * workers and kernel hog threads are started if they are not running.
+ */
+int set_cpu_load(int cpu, int sys, int pct)
+{
+    unsigned int old;
+    int ret;
+
+    if (cpu < 0 || cpu >= cpus_onln || pct < 0 || pct > 100)
+        return -EINVAL;
+
+    if (!sys) {
+        __atomic_store_n(&user_loads[cpu].load_msec, PCT_TO_MSEC(pct),
+                         __ATOMIC_RELAXED);
+        if (!engine_running(&cpu_engine) && pct)
+            return engine_start(&cpu_engine);
+        return 0;
+    }
+
+    if (pct + sys_load.irq + sys_load.softirq + sys_load.idle > 100)
+        return -EINVAL;
+    old = sys_loads[cpu].load_msec;
+    sys_loads[cpu].load_msec = PCT_TO_MSEC(pct);
+    if (engine_running(&kmod_engine)) {
+        if ((ret = nl_send_cpu_load(cpu)) < 0) {
+            sys_loads[cpu].load_msec = old;
+            return ret;
+        }
+    }
+    else if (pct && (ret = engine_start(&kmod_engine)) < 0) {
+        sys_loads[cpu].load_msec = old;
+        return ret;
+    }
     return 0;
 }
+
+/* Wake-up lateness of the user load worker of a CPU over the last
+ * reporting interval and in total.
+ */
+int cpu_jitter(int cpu, struct lat_hist *last, struct lat_hist *total)
+{
+    if (!engine_running(&cpu_engine) || cpu < 0 || cpu >= cpus_onln)
+        return -ESRCH;
+    *last = cpu_jitter_last[cpu];
+    *total = cpu_jitter_prev[cpu];
+    return 0;
+}
+
+static void on_term_signal(int sig)
+{
+    stop_requested = 1;
+}
+
+static void report_engines(FILE *stream, double interval)
+{
+    int i;
+
+    for (i = 0; engines[i]; i++)
+        if (engines[i]->report && engine_on[i])
+            engines[i]->report(stream, interval);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret, status = EXIT_SUCCESS;
+    struct sigaction sa;
+    unsigned long prev, now;
+    FILE *stream;
+    char *buf;
+    size_t len;
+
+    cpus_onln = sysconf(_SC_NPROCESSORS_ONLN);
+    getargs(argc, argv, &sys_load);
+
+    user_loads = shared_alloc(cpus_onln * sizeof(struct cpu_load));
+    sys_loads = calloc(cpus_onln, sizeof(struct cpu_load));
+    if (!sys_loads)
+        err_exit("calloc");
+    for (i = 0; i < cpus_onln; i++) {
+        user_loads[i].cpu_num = sys_loads[i].cpu_num = i;
+        user_loads[i].load_msec = PCT_TO_MSEC(sys_load.ut);
+        sys_loads[i].load_msec = PCT_TO_MSEC(sys_load.st);
+    }
+
+    /* Stop engines on SIGINT/SIGTERM so that kthreads don't outlive us */
+    sa.sa_handler = on_term_signal;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0)
+        err_exit("sigaction");
+
+    if (controller_port) {
+        ret = controller_run(controller_port, controller_agents,
+                             start_delay_ms, join_timeout_s, &sys_load,
+                             &stop_requested);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* Take the plan and wait for the common start */
+    if (agent_addr) {
+        period_epoch_ns = agent_init(agent_addr, user_loads, sys_loads);
+        sleep_until_ns(period_epoch_ns);
+    }
+
+    /* Only the daemon carries on without an engine that fails */
+    for (i = 0; engines[i] && !stop_requested; i++) {
+        if (!engines[i]->enabled(&sys_load) ||
+            (ret = engine_start(engines[i])) == 0)
+            continue;
+        fprintf(stderr, "%s: %s engine is stopped: %s\n", progname,
+                engines[i]->name, strerror(-ret));
+        if (!daemon_mode) {
+            status = EXIT_FAILURE;
+            stop_requested = 1;
+        }
+    }
+
+    if (daemon_mode)
+        daemon_init(control_path, metrics_port);
+
+    prev = now_ns();
+    while (!stop_requested) {
+        if (daemon_mode) {
+            if (daemon_poll(prev + NSEC_PER_SEC))
+                break;
+        }
+        else if (agent_addr) {
+            if (agent_poll(prev + NSEC_PER_SEC))
+                break;
+        }
+        else
+            sleep(1);
+        if (stop_requested)
+            break;
+
+        now = now_ns();
+        if (now < prev + NSEC_PER_SEC)
+            continue;
+
+        if (!daemon_mode && !agent_addr)
+            report_engines(stdout, (now - prev) / NSEC_PER_SEC);
+        else {
+            /* Keep a copy of the report for the stats command or the
+             * controller
+             */
+            stream = open_memstream(&buf, &len);
+            if (!stream)
+                err_exit("open_memstream");
+            report_engines(stream, (now - prev) / NSEC_PER_SEC);
+            fclose(stream);
+            fputs(buf, stdout);
+            if (daemon_mode)
+                daemon_tick(buf);
+            else
+                agent_tick(buf, cpu_user_usage(), kmod_sys_usage());
+            free(buf);
+        }
+        fflush(stdout);
+        prev = now;
+    }
+
+    if (daemon_mode)
+        daemon_fini();
+    if (agent_addr)
+        agent_fini();
+
+    for (i = sizeof(engines) / sizeof(engines[0]) - 2; i >= 0; i--)
+        if (engine_on[i])
+            engine_stop(engines[i]);
+
+    return status;
+}
@@ -0,0 +1,272 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "cpu_nl.h"
+
+#define err_exit(msg)           \
+        do {                    \
+            perror(msg);        \
+            exit(EXIT_FAILURE); \
+        } while (0)
+
+#define PCT_TO_MSEC(x)     (x * 10)
+#define MSEC_TO_NSEC(x)    (x * 1e6)
+#define NSEC_PER_SEC       1e9
+#define PCT_TO_NSEC(x)     ((x) * 10000000U)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()        __builtin_ia32_pause()
+#else
+#define cpu_relax()        __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* The name this program was invoked by. */
+extern char *progname;
+
+/* Number of present CPUs. */
+extern int cpus_onln;
+
+/* Set by SIGINT and SIGTERM; long engine setup gives up on it. */
+extern volatile sig_atomic_t stop_requested;
+
+/* Cache-coherence workload kinds */
+enum coh_mode {
+    COH_NONE,
+    COH_ATOMIC,        /* true sharing: one atomic counter for the group */
+    COH_FALSE,         /* false sharing: private counters, 8 per line */
+    COH_SPIN,          /* spinlock protecting a shared counter */
+    COH_MUTEX          /* futex-based process-shared pthread mutex */
+};
+
+/* Which CPUs a coherence group is built from */
+enum coh_topo {
+    COH_TOPO_CORE,     /* SMT siblings of one physical core */
+    COH_TOPO_LLC,      /* CPUs sharing the last level cache */
+    COH_TOPO_CROSS     /* one CPU from each socket */
+};
+
+/* Cache-coherence and lock-contention load */
+struct coh_load {
+    enum coh_mode mode;
+    enum coh_topo topo;
+    unsigned long rate;        /* target ops per second per worker, 0: max */
+    int workers;               /* workers per group, 0: whole domain */
+    int groups;                /* number of groups */
+};
+
+/* I/O access patterns */
+enum io_rw {
+    IO_READ,
+    IO_WRITE,
+    IO_RW,
+    IO_RANDREAD,
+    IO_RANDWRITE,
+    IO_RANDRW
+};
+
+enum io_engine {
+    IO_ENGINE_URING,   /* io_uring with registered buffers */
+    IO_ENGINE_PSYNC    /* pread/pwrite, queue depth 1 */
+};
+
+/* Storage I/O load. Rates are totals over all jobs; with neither iops
+ * nor bw set the queue is kept full during the active part of a period.
+ */
+struct io_load {
+    const char *file;          /* NULL: engine disabled */
+    enum io_rw rw;
+    enum io_engine engine;
+    unsigned long bs;          /* block size, bytes */
+    unsigned long size;        /* file size, bytes */
+    unsigned int depth;        /* queue depth per job */
+    unsigned int jobs;
+    int direct;                /* O_DIRECT */
+    unsigned long iops;
+    unsigned long bw;          /* bytes per second */
+    int duty;                  /* active part of each period: [1-100] */
+};
+
+/* Page-cache and dirty-writeback load. The resident set is kept in
+ * the page cache; the cycled set is read through at read_rate, which
+ * thrashes the cache when it is larger than RAM.
+ */
+struct pc_load {
+    const char *dir;           /* NULL: engine disabled */
+    unsigned long resident;    /* bytes kept resident */
+    unsigned long set;         /* bytes of the cycled file set */
+    unsigned long read_rate;   /* bytes per second, 0: unlimited */
+    unsigned long dirty_rate;  /* bytes per second dirtied */
+    unsigned long dirty_size;  /* size of the file being dirtied */
+};
+
+/* How scheduler-stress tasks are created */
+enum sched_type {
+    SCHED_TYPE_THREAD,
+    SCHED_TYPE_PROCESS,
+    SCHED_TYPE_KTHREAD     /* created by kloadgend, timer wakeups only */
+};
+
+/* How scheduler-stress tasks are woken */
+enum sched_wake {
+    SCHED_WAKE_TIMER,      /* every task sleeps on its own timer */
+    SCHED_WAKE_FUTEX,      /* a timer starts a futex wake chain per CPU */
+    SCHED_WAKE_PIPE        /* a timer starts a pipe ping-pong chain */
+};
+
+/* Scheduler stress: many short-running tasks per CPU that together keep
+ * each CPU busy util percent of the time.
+ */
+struct sched_stress {
+    unsigned int tasks;        /* tasks per CPU, 0: engine disabled */
+    int util;                  /* [0-100] */
+    enum sched_type type;
+    enum sched_wake wake;
+    unsigned int period_ms;    /* every task runs once per period */
+    int pin;                   /* keep tasks on their home CPU */
+};
+
+#define SCHED_MIN_WORK_NS  1000     /* shorter bursts are all overhead */
+#define SCHED_KTHREAD_MAX  100000   /* kloadgend limit on all CPUs */
+
+/* Resources whose pressure stall information can be targeted */
+enum psi_resource {
+    PSI_NONE,
+    PSI_CPU,
+    PSI_MEMORY,
+    PSI_IO
+};
+
+/* Pressure-targeted load: a controller scales the load on one resource
+ * until its stall share reaches target percent.
+ */
+struct psi_load {
+    enum psi_resource res;     /* PSI_NONE: engine disabled */
+    double target;             /* stall time, percent */
+    int full;                  /* control the full rather than some line */
+    const char *cgroup;        /* cgroup v2 directory, NULL: system-wide */
+    unsigned int max_tasks;    /* cpu and io load tasks */
+    unsigned long mem_max;     /* largest memory footprint, bytes */
+    const char *dir;           /* where the io load file goes */
+    const char *log;           /* trajectory log, CSV */
+};
+
+/* Vector of system load values. CPU values are given in percentages:
+ * [0-100]; the other workloads carry their own descriptors.
+ */
+struct sys_load {
+    int st;
+    int ut;
+    int mem;
+    int irq;                   /* hardirq time, injected by kloadgend */
+    int softirq;               /* softirq time, injected by kloadgend */
+    unsigned int irq_hz;       /* rate of injected interrupts */
+    unsigned int softirq_hz;   /* rate of injected tasklets */
+    int idle;                  /* forced idle time, injected by kloadgend */
+    unsigned int idle_period_ms;
+    struct coh_load coh;
+    struct io_load io;
+    struct pc_load pc;
+    struct sched_stress sched;
+    struct psi_load psi;
+};
+
+/* Load engine. Each engine forks its own workers in start() and reaps
+ * them in stop(); report() is called once per reporting interval.
+ * start() returns a negative errno, after saying why, if the engine
+ * can't run, and leaves nothing behind then.
+ */
+struct engine {
+    const char *name;
+    int (*enabled)(const struct sys_load *sys_load);
+    int (*start)(const struct sys_load *sys_load);
+    void (*stop)(void);
+    void (*report)(FILE *stream, double interval);
+};
+
+extern const struct engine kmod_engine;
+extern const struct engine cpu_engine;
+extern const struct engine coh_engine;
+extern const struct engine io_engine;
+extern const struct engine pc_engine;
+extern const struct engine sched_engine;
+extern const struct engine psi_engine;
+
+/* All engines in start order, NULL-terminated */
+extern const struct engine *const engines[];
+
+/* Latency histogram: exact below 16 ns, then 8 linear sub-buckets per
+ * power of two, which keeps the relative error under 12.5%.
+ */
+#define LAT_HIST_BUCKETS   (16 + 60 * 8)
+
+struct lat_hist {
+    unsigned long count[LAT_HIST_BUCKETS];
+    unsigned long n;
+    unsigned long sum;
+    unsigned long max;
+};
+
+/* Per-CPU times from /proc/stat, in USER_HZ ticks */
+struct cpu_times {
+    unsigned long user;
+    unsigned long nice;
+    unsigned long system;
+    unsigned long idle;
+    unsigned long iowait;
+    unsigned long irq;
+    unsigned long softirq;
+    unsigned long steal;
+};
+
+/* util.c */
+extern unsigned long period_epoch_ns;
+int err_ret(const char *msg);
+int parse_pct(const char *s, int *pct);
+int parse_size(const char *s, unsigned long *size);
+unsigned long now_ns(void);
+void sleep_until_ns(unsigned long ns);
+void burn_ns(unsigned long ns);
+unsigned long period_start_ns(int ind, int num);
+pid_t spawn_worker(void (*fn)(void *), void *arg, int cpu);
+void kill_workers(pid_t *pids, int n);
+void *shared_alloc(size_t size);
+void shared_free(void *p, size_t size);
+void lat_hist_add(struct lat_hist *h, unsigned long ns);
+void lat_hist_snap(struct lat_hist *out, struct lat_hist *live,
+                   struct lat_hist *prev);
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+unsigned long lat_hist_pct(const struct lat_hist *h, double pct);
+int read_cpu_times(struct cpu_times *times, int ncpus);
+unsigned long cpu_times_total(const struct cpu_times *t);
+
+/* loadgen.c: run-time control. Errors are negative errno values. */
+int engine_enabled(const struct engine *e);
+int engine_running(const struct engine *e);
+int engine_start(const struct engine *e);
+int engine_stop(const struct engine *e);
+int get_cpu_load(int cpu, int sys);
+int set_cpu_load(int cpu, int sys, int pct);
+int cpu_jitter(int cpu, struct lat_hist *last, struct lat_hist *total);
+
+/* daemon.c */
+void daemon_init(const char *path, unsigned int metrics_port);
+int daemon_poll(unsigned long until_ns);
+void daemon_tick(const char *report);
+void daemon_fini(void);
+
+/* cluster.c */
+int controller_run(unsigned int port, int nagents, unsigned int delay_ms,
+                   unsigned int timeout_s, const struct sys_load *sys_load,
+                   volatile sig_atomic_t *stop);
+unsigned long agent_init(const char *addr, struct cpu_load *user,
+                         struct cpu_load *sys);
+int agent_poll(unsigned long until_ns);
+void agent_tick(const char *report, double user, double sys);
+void agent_fini(void);
+
+#endif	/* LOADGEN_H */
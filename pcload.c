@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loadgen.h"
+
+#define PC_FILE_MAX        (1UL << 30)     /* file set is split into 1G files */
+#define PC_CHUNK           (1UL << 20)
+#define PC_BACKLOG_NS      100000000UL     /* writes made up after a stall */
+#define PC_MAX_FILES       4096
+
+/* Counters shared with the parent */
+struct pc_stats {
+    unsigned long resident;    /* bytes of the resident set in cache */
+    unsigned long refetched;   /* bytes of it read back after eviction */
+    unsigned long read;        /* bytes read from the cycled set */
+    unsigned long dirtied;     /* bytes written to the dirty file */
+    unsigned long errors;      /* failed reads and writes */
+    struct lat_hist write_lat;
+};
+
+/* /proc/vmstat entries to report. Counters are shown as rates, gauges
+ * (in pages) as megabytes; prefix entries sum all matching lines.
+ */
+struct vmstat_item {
+    const char *name;
+    int prefix;
+    int gauge;
+    unsigned long val;
+    unsigned long prev;
+};
+
+static struct vmstat_item vmstat_items[] = {
+    {"pgscan_kswapd", 0, 0},
+    {"pgscan_direct", 0, 0},
+    {"pgsteal_kswapd", 0, 0},
+    {"pgsteal_direct", 0, 0},
+    {"workingset_refault", 1, 0},
+    {"allocstall", 1, 0},
+    {"nr_dirtied", 0, 0},
+    {"nr_written", 0, 0},
+    {"pgpgin", 0, 0},
+    {"pgpgout", 0, 0},
+    {"nr_file_pages", 0, 1},
+    {"nr_dirty", 0, 1},
+    {"nr_writeback", 0, 1},
+    {"nr_dirty_threshold", 0, 1},
+    {"nr_dirty_background_threshold", 0, 1},
+    {NULL}
+};
+
+enum {
+    PC_WORKER_RESIDENT,
+    PC_WORKER_CYCLE,
+    PC_WORKER_DIRTY,
+    PC_WORKERS
+};
+
+/* File set of each worker */
+static const char *const pc_sets[PC_WORKERS] = {
+    [PC_WORKER_RESIDENT] = "resident",
+    [PC_WORKER_CYCLE] = "set",
+    [PC_WORKER_DIRTY] = "dirty",
+};
+
+static struct pc_load pc;
+static struct pc_stats *stats;
+static pid_t pc_pids[PC_WORKERS];
+static unsigned char pc_created[PC_WORKERS][PC_MAX_FILES];
+static unsigned long pc_page;
+static struct pc_stats prev;
+static struct lat_hist prev_lat;
+
+/* Name of the ind-th file of a set */
+static void pc_path(char *buf, size_t len, const char *set, int ind)
+{
+    snprintf(buf, len, "%s/loadgen-%s.%d", pc.dir, set, ind);
+}
+
+static int pc_nfiles(unsigned long size)
+{
+    return (size + PC_FILE_MAX - 1) / PC_FILE_MAX;
+}
+
+static unsigned long pc_file_size(unsigned long size, int ind)
+{
+    unsigned long left = size - ind * PC_FILE_MAX;
+
+    return left < PC_FILE_MAX ? left : PC_FILE_MAX;
+}
+
+/* Make sure the file exists with at least size bytes of real data.
+ * Files that weren't there are noted, to be removed on stop.
+ */
+static int pc_prepare_file(int set, int ind, unsigned long size, int drop)
+{
+    char path[4096];
+    struct stat sb;
+    unsigned long off, n;
+    char *buf = NULL;
+    int fd, ret = 0;
+
+    pc_path(path, sizeof(path), pc_sets[set], ind);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0)
+        pc_created[set][ind] = 1;
+    else if (errno == EEXIST)
+        fd = open(path, O_RDWR);
+    if (fd < 0)
+        return err_ret(path);
+    if (fstat(fd, &sb) < 0) {
+        ret = err_ret(path);
+        goto out;
+    }
+    if ((unsigned long) sb.st_size >= size)
+        goto out;
+
+    buf = malloc(PC_CHUNK);
+    if (!buf)
+        err_exit("malloc");
+    memset(buf, 0x5a, PC_CHUNK);
+
+    for (off = sb.st_size; off < size; off += n) {
+        n = size - off < PC_CHUNK ? size - off : PC_CHUNK;
+        errno = ENOSPC;
+        if (pwrite(fd, buf, n, off) != (ssize_t) n) {
+            ret = err_ret(path);
+            goto out;
+        }
+    }
+
+    /* Start the cycled set cold */
+    if (drop) {
+        if (fdatasync(fd) < 0) {
+            ret = err_ret(path);
+            goto out;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+out:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int pc_prepare_set(int set, unsigned long size, int drop)
+{
+    int i, ret;
+
+    for (i = 0; i < pc_nfiles(size); i++) {
+        ret = pc_prepare_file(set, i, pc_file_size(size, i), drop);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static void pc_remove_files(void)
+{
+    char path[4096];
+    int set, i;
+
+    for (set = 0; set < PC_WORKERS; set++)
+        for (i = 0; i < PC_MAX_FILES; i++)
+            if (pc_created[set][i]) {
+                pc_path(path, sizeof(path), pc_sets[set], i);
+                unlink(path);
+                pc_created[set][i] = 0;
+            }
+}
+
+/* Files are prepared by pc_start(), workers only open them */
+static int pc_open_file(int set, int ind, int flags)
+{
+    char path[4096];
+    int fd;
+
+    pc_path(path, sizeof(path), pc_sets[set], ind);
+    fd = open(path, flags);
+    if (fd < 0)
+        err_exit(path);
+    return fd;
+}
+
+/* Keep the resident set in the page cache: once a second check which
+ * pages were reclaimed and fault them back in.
+ */
+static void pc_resident_func(void *arg)
+{
+    int nfiles = pc_nfiles(pc.resident);
+    unsigned char *vec;
+    char *maps[PC_MAX_FILES];
+    unsigned long sizes[PC_MAX_FILES];
+    unsigned long next, resident, refetched, p, npages;
+    volatile char c;
+    int i, fd;
+
+    vec = malloc(PC_FILE_MAX / pc_page);
+    if (!vec)
+        err_exit("malloc");
+
+    for (i = 0; i < nfiles; i++) {
+        sizes[i] = pc_file_size(pc.resident, i);
+        fd = pc_open_file(PC_WORKER_RESIDENT, i, O_RDONLY);
+        maps[i] = mmap(NULL, sizes[i], PROT_READ, MAP_SHARED, fd, 0);
+        if (maps[i] == MAP_FAILED)
+            err_exit("mmap");
+        close(fd);
+    }
+
+    next = now_ns();
+    while (1) {
+        resident = refetched = 0;
+        for (i = 0; i < nfiles; i++) {
+            npages = (sizes[i] + pc_page - 1) / pc_page;
+            if (mincore(maps[i], sizes[i], vec) < 0)
+                err_exit("mincore");
+            for (p = 0; p < npages; p++) {
+                if (vec[p] & 1) {
+                    resident += pc_page;
+                    continue;
+                }
+                c = maps[i][p * pc_page];
+                refetched += pc_page;
+            }
+        }
+        (void) c;
+
+        __atomic_store_n(&stats->resident, resident, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->refetched, refetched, __ATOMIC_RELAXED);
+
+        next += NSEC_PER_SEC;
+        sleep_until_ns(next);
+    }
+}
+
+/* Walk sequentially through the cycled set at pc.read_rate */
+static void pc_cycle_func(void *arg)
+{
+    int nfiles = pc_nfiles(pc.set);
+    int fds[PC_MAX_FILES];
+    unsigned long sizes[PC_MAX_FILES];
+    unsigned long off, next, period_ns;
+    char *buf;
+    ssize_t n;
+    int i;
+
+    buf = malloc(PC_CHUNK);
+    if (!buf)
+        err_exit("malloc");
+
+    for (i = 0; i < nfiles; i++) {
+        sizes[i] = pc_file_size(pc.set, i);
+        fds[i] = pc_open_file(PC_WORKER_CYCLE, i, O_RDONLY);
+    }
+
+    period_ns = pc.read_rate ? NSEC_PER_SEC * PC_CHUNK / pc.read_rate : 0;
+    next = now_ns();
+    while (1) {
+        for (i = 0; i < nfiles; i++)
+            for (off = 0; off < sizes[i]; off += PC_CHUNK) {
+                n = pread(fds[i], buf, PC_CHUNK, off);
+                if (n < 0)
+                    __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+                else
+                    __atomic_fetch_add(&stats->read, n, __ATOMIC_RELAXED);
+
+                if (period_ns) {
+                    next += period_ns;
+                    sleep_until_ns(next);
+                }
+            }
+    }
+}
+
+/* Dirty pages of one file at pc.dirty_rate, leaving writeback to the
+ * kernel so that writers get throttled in balance_dirty_pages().
+ */
+static void pc_dirty_func(void *arg)
+{
+    unsigned long off = 0, next, t, period_ns;
+    char *buf;
+    int fd;
+
+    buf = malloc(PC_CHUNK);
+    if (!buf)
+        err_exit("malloc");
+    memset(buf, 0xd1, PC_CHUNK);
+
+    fd = pc_open_file(PC_WORKER_DIRTY, 0, O_WRONLY);
+
+    period_ns = NSEC_PER_SEC * PC_CHUNK / pc.dirty_rate;
+    next = now_ns();
+    while (1) {
+        t = now_ns();
+        if (pwrite(fd, buf, PC_CHUNK, off) != PC_CHUNK) {
+            __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            lat_hist_add(&stats->write_lat, now_ns() - t);
+            __atomic_fetch_add(&stats->dirtied, PC_CHUNK, __ATOMIC_RELAXED);
+        }
+
+        off += PC_CHUNK;
+        if (off + PC_CHUNK > pc.dirty_size)
+            off = 0;
+
+        /* Time spent throttled is not made up beyond a short backlog,
+         * or the writes would come in bursts.
+         */
+        next += period_ns;
+        t = now_ns();
+        if (next + PC_BACKLOG_NS < t)
+            next = t - PC_BACKLOG_NS;
+        sleep_until_ns(next);
+    }
+}
+
+static void vmstat_read(void)
+{
+    char name[64];
+    unsigned long val;
+    FILE *f;
+    int i;
+
+    for (i = 0; vmstat_items[i].name; i++)
+        vmstat_items[i].val = 0;
+
+    f = fopen("/proc/vmstat", "r");
+    if (!f)
+        return;
+    while (fscanf(f, "%63s %lu", name, &val) == 2)
+        for (i = 0; vmstat_items[i].name; i++) {
+            struct vmstat_item *it = &vmstat_items[i];
+
+            if (it->prefix ?
+                strncmp(name, it->name, strlen(it->name)) == 0 :
+                strcmp(name, it->name) == 0)
+                it->val += val;
+        }
+    fclose(f);
+}
+
+static int pc_enabled(const struct sys_load *sys_load)
+{
+    return sys_load->pc.dir != NULL;
+}
+
+static int pc_start(const struct sys_load *sys_load)
+{
+    int i, ret = 0;
+
+    pc = sys_load->pc;
+    pc_page = sysconf(_SC_PAGESIZE);
+    if (!pc.dirty_size)
+        pc.dirty_size = 1UL << 30;
+    if (pc.dirty_size < PC_CHUNK)
+        pc.dirty_size = PC_CHUNK;
+
+    if (pc_nfiles(pc.resident) > PC_MAX_FILES ||
+        pc_nfiles(pc.set) > PC_MAX_FILES) {
+        fprintf(stderr, "%s: page cache file set is too large\n", progname);
+        return -EINVAL;
+    }
+    if (!pc.resident && !pc.set && !pc.dirty_rate) {
+        fprintf(stderr, "%s: --pc-dir needs --pc-resident, --pc-set or "
+                "--pc-dirty\n", progname);
+        return -EINVAL;
+    }
+
+    /* The dirty file grows as it is written */
+    if (pc.resident)
+        ret = pc_prepare_set(PC_WORKER_RESIDENT, pc.resident, 0);
+    if (!ret && pc.set)
+        ret = pc_prepare_set(PC_WORKER_CYCLE, pc.set, 1);
+    if (!ret && pc.dirty_rate)
+        ret = pc_prepare_file(PC_WORKER_DIRTY, 0, 0, 0);
+    if (ret < 0) {
+        pc_remove_files();
+        return ret;
+    }
+
+    stats = shared_alloc(sizeof(struct pc_stats));
+    memset(&prev, 0, sizeof(prev));
+    memset(&prev_lat, 0, sizeof(prev_lat));
+    vmstat_read();
+    for (i = 0; vmstat_items[i].name; i++)
+        vmstat_items[i].prev = vmstat_items[i].val;
+
+    if (pc.resident)
+        pc_pids[PC_WORKER_RESIDENT] = spawn_worker(pc_resident_func, NULL, -1);
+    if (pc.set)
+        pc_pids[PC_WORKER_CYCLE] = spawn_worker(pc_cycle_func, NULL, -1);
+    if (pc.dirty_rate)
+        pc_pids[PC_WORKER_DIRTY] = spawn_worker(pc_dirty_func, NULL, -1);
+    return 0;
+}
+
+static void pc_stop(void)
+{
+    kill_workers(pc_pids, PC_WORKERS);
+    shared_free(stats, sizeof(struct pc_stats));
+    stats = NULL;
+    pc_remove_files();
+}
+
+static void pc_report(FILE *stream, double interval)
+{
+    struct lat_hist *lat;
+    unsigned long refetched, read, dirtied, errors;
+    int i;
+
+    lat = malloc(sizeof(struct lat_hist));
+    if (!lat)
+        err_exit("malloc");
+
+    refetched = __atomic_load_n(&stats->refetched, __ATOMIC_RELAXED);
+    read = __atomic_load_n(&stats->read, __ATOMIC_RELAXED);
+    dirtied = __atomic_load_n(&stats->dirtied, __ATOMIC_RELAXED);
+    errors = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+    lat_hist_snap(lat, &stats->write_lat, &prev_lat);
+
+    fprintf(stream, "pc: resident %.0f/%.0f MiB refetched %.1f MB/s, "
+            "read %.1f MB/s, dirtied %.1f MB/s write us p99 %.0f max %.0f",
+            __atomic_load_n(&stats->resident, __ATOMIC_RELAXED) / 1048576.0,
+            pc.resident / 1048576.0,
+            (refetched - prev.refetched) / interval / 1e6,
+            (read - prev.read) / interval / 1e6,
+            (dirtied - prev.dirtied) / interval / 1e6,
+            lat_hist_pct(lat, 99) / 1e3, lat->max / 1e3);
+    if (errors != prev.errors)
+        fprintf(stream, ", %lu errors", errors - prev.errors);
+    fprintf(stream, "\n");
+
+    vmstat_read();
+    fprintf(stream, "vmstat:");
+    for (i = 0; vmstat_items[i].name; i++) {
+        struct vmstat_item *it = &vmstat_items[i];
+
+        if (it->gauge)
+            fprintf(stream, " %s %.0fM", it->name,
+                    it->val * pc_page / 1048576.0);
+        else
+            fprintf(stream, " %s %.0f/s", it->name,
+                    (it->val - it->prev) / interval);
+        it->prev = it->val;
+    }
+    fprintf(stream, "\n");
+
+    prev.refetched = refetched;
+    prev.read = read;
+    prev.dirtied = dirtied;
+    prev.errors = errors;
+    free(lat);
+}
+
+const struct engine pc_engine = {
+    .name = "pc",
+    .enabled = pc_enabled,
+    .start = pc_start,
+    .stop = pc_stop,
+    .report = pc_report,
+};
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loadgen.h"
+
+#define PSI_PERIOD_NS      100000000UL     /* duty cycle of load tasks */
+#define PSI_IO_BS          4096UL
+#define PSI_IO_SIZE        (256UL << 20)
+#define PSI_IO_CHUNK       (1UL << 20)
+
+/* Controller gains, per percent of pressure error. The output is the
+ * load effort in [0-1] of its maximum.
+ */
+#define PSI_KP             0.002
+#define PSI_KI             0.001
+/* Weight of a new 1 s measurement in the filtered pressure */
+#define PSI_FILTER         0.3
+/* Error, in percent of the target, that is left alone */
+#define PSI_DEADBAND       0.02
+/* Memory stalls only start once reclaim does: cross that sooner */
+#define PSI_MEM_GAIN       10
+
+/* Actuator state, set by the controller and read by load tasks, and
+ * the last measurement for the report.
+ */
+struct psi_ctl {
+    volatile unsigned int tasks;           /* load tasks busy all the time */
+    volatile unsigned long busy_ns;        /* of the next one per period */
+    volatile unsigned long footprint;      /* memory bytes touched */
+    volatile double pressure;              /* over the last second */
+    volatile double avg10;
+    volatile double effort;
+};
+
+static const char *const psi_names[] = {
+    [PSI_CPU] = "cpu",
+    [PSI_MEMORY] = "memory",
+    [PSI_IO] = "io",
+};
+
+static struct psi_load psi;
+static struct psi_ctl *ctl;
+static pid_t *psi_pids;
+static int psi_nr_pids;
+static char psi_file[4096];
+static char io_path[4096];
+static unsigned long psi_page;
+
+/* Read the some or full line of a pressure file: avg10 in percent and
+ * the total stall time in microseconds.
+ */
+static int psi_read(double *avg10, unsigned long *total)
+{
+    char kind[8];
+    double a10, a60, a300;
+    unsigned long t;
+    FILE *f;
+    int ret = -1;
+
+    f = fopen(psi_file, "r");
+    if (!f)
+        return -1;
+    while (fscanf(f, "%7s avg10=%lf avg60=%lf avg300=%lf total=%lu",
+                  kind, &a10, &a60, &a300, &t) == 5) {
+        if (strcmp(kind, psi.full ? "full" : "some") == 0) {
+            *avg10 = a10;
+            *total = t;
+            ret = 0;
+            break;
+        }
+    }
+    fclose(f);
+
+    return ret;
+}
+
+/* Spread the effort over load tasks: whole tasks are kept busy all the
+ * time and one more takes the remainder as its duty cycle. Sharing it
+ * out evenly would make the pressure jump whenever a task is added, as
+ * the tasks start to overlap all at once.
+ */
+static void psi_actuate(double effort)
+{
+    double demand;
+    unsigned int tasks;
+
+    ctl->effort = effort;
+    if (psi.res == PSI_MEMORY) {
+        ctl->footprint = effort * psi.mem_max / psi_page * psi_page;
+        return;
+    }
+
+    demand = effort * psi.max_tasks;
+    tasks = demand;
+    ctl->busy_ns = (demand - tasks) * PSI_PERIOD_NS;
+    ctl->tasks = tasks;
+}
+
+/* PI controller on the stall share of the last seconds: avg10 lags by
+ * tens of seconds, so steering by it would overshoot, while a single
+ * second is too noisy. Errors within the deadband are left alone.
+ */
+static void psi_ctl_func(void *arg)
+{
+    struct sched_param param = { .sched_priority = 1 };
+    unsigned long start, next, t, total, prev_total, prev_t;
+    double avg10, pressure, filtered, err, prev_err = 0, effort, gain;
+    FILE *log = NULL;
+
+    /* Keep measuring while the load tasks starve everyone else */
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        fprintf(stderr, "%s: psi: can't make the controller SCHED_FIFO, "
+                "it may lag behind the load: %s\n", progname,
+                strerror(errno));
+
+    if (psi.log) {
+        log = fopen(psi.log, "w");
+        if (!log)
+            err_exit("fopen");
+        fprintf(log, "time,avg10,pressure,filtered,target,effort,tasks,"
+                "duty,footprint\n");
+    }
+
+    if (psi_read(&avg10, &prev_total) < 0)
+        err_exit(psi_file);
+
+    gain = psi.res == PSI_MEMORY ? PSI_MEM_GAIN : 1;
+    effort = ctl->effort;
+    filtered = avg10;
+    start = prev_t = next = now_ns();
+    while (1) {
+        next += NSEC_PER_SEC;
+        sleep_until_ns(next);
+
+        t = now_ns();
+        if (psi_read(&avg10, &total) < 0)
+            err_exit(psi_file);
+        pressure = (total - prev_total) * 1e5 / (t - prev_t);
+        if (pressure > 100)
+            pressure = 100;
+        prev_total = total;
+        prev_t = t;
+        filtered += PSI_FILTER * (pressure - filtered);
+
+        err = psi.target - filtered;
+        if (fabs(err) < PSI_DEADBAND * psi.target)
+            err = 0;
+        effort += gain * (PSI_KP * (err - prev_err) + PSI_KI * err);
+        prev_err = err;
+        if (effort < 0)
+            effort = 0;
+        if (effort > 1)
+            effort = 1;
+
+        ctl->pressure = filtered;
+        ctl->avg10 = avg10;
+        psi_actuate(effort);
+
+        if (log) {
+            fprintf(log, "%.0f,%.2f,%.2f,%.2f,%.2f,%.4f,%u,%.1f,%lu\n",
+                    (t - start) / NSEC_PER_SEC, avg10, pressure, filtered,
+                    psi.target, effort, ctl->tasks,
+                    ctl->busy_ns * 100.0 / PSI_PERIOD_NS, ctl->footprint);
+            fflush(log);
+        }
+    }
+}
+
+/* How long load task ind is busy this period */
+static unsigned long psi_busy_ns(long ind)
+{
+    unsigned int tasks = ctl->tasks;
+
+    if (ind < tasks)
+        return PSI_PERIOD_NS;
+    return ind == tasks ? ctl->busy_ns : 0;
+}
+
+/* A runnable task for its share of every period, asleep otherwise */
+static void psi_cpu_func(void *arg)
+{
+    long ind = (long) arg;
+    unsigned long next;
+
+    next = now_ns() / PSI_PERIOD_NS * PSI_PERIOD_NS +
+           PSI_PERIOD_NS / psi.max_tasks * ind;
+    while (1) {
+        burn_ns(psi_busy_ns(ind));
+        next += PSI_PERIOD_NS;
+        if (next < now_ns())
+            next = now_ns();
+        sleep_until_ns(next);
+    }
+}
+
+/* Like psi_cpu_func, but spends its share waiting for synchronous I/O:
+ * random direct reads if the file system allows them, or writes
+ * flushed by fdatasync otherwise.
+ */
+static void psi_io_func(void *arg)
+{
+    long ind = (long) arg;
+    unsigned long next, end, busy, seed = ind * 2654435761UL + 1;
+    off_t off;
+    void *buf;
+    int fd, direct = 1;
+
+    if (posix_memalign(&buf, PSI_IO_BS, PSI_IO_BS))
+        err_exit("posix_memalign");
+    memset(buf, 0x5a, PSI_IO_BS);
+
+    fd = open(io_path, O_RDWR | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        direct = 0;
+        fd = open(io_path, O_RDWR);
+    }
+    if (fd < 0)
+        err_exit("open");
+
+    next = now_ns() / PSI_PERIOD_NS * PSI_PERIOD_NS +
+           PSI_PERIOD_NS / psi.max_tasks * ind;
+    while (1) {
+        busy = psi_busy_ns(ind);
+        if (busy) {
+            end = now_ns() + busy;
+            while (now_ns() < end) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                off = seed % (PSI_IO_SIZE / PSI_IO_BS) * PSI_IO_BS;
+                if (direct) {
+                    if (pread(fd, buf, PSI_IO_BS, off) < 0)
+                        err_exit("pread");
+                }
+                else {
+                    if (pwrite(fd, buf, PSI_IO_BS, off) < 0)
+                        err_exit("pwrite");
+                    if (fdatasync(fd) < 0)
+                        err_exit("fdatasync");
+                }
+            }
+        }
+        next += PSI_PERIOD_NS;
+        if (next < now_ns())
+            next = now_ns();
+        sleep_until_ns(next);
+    }
+}
+
+/* Keep a share of the footprint in use by touching every page of it
+ * every period; memory above the footprint is handed back.
+ */
+static void psi_mem_func(void *arg)
+{
+    unsigned long size = psi.mem_max / cpus_onln / psi_page * psi_page;
+    unsigned long want, have = 0, p, next;
+    char *mem;
+    FILE *f;
+
+    /* If the OOM killer has to step in, take us first */
+    f = fopen("/proc/self/oom_score_adj", "w");
+    if (f) {
+        fprintf(f, "1000\n");
+        fclose(f);
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        err_exit("mmap");
+
+    next = now_ns();
+    while (1) {
+        want = ctl->footprint / cpus_onln / psi_page * psi_page;
+        if (want > size)
+            want = size;
+        if (want < have && madvise(mem + want, have - want,
+                                   MADV_DONTNEED) < 0)
+            err_exit("madvise");
+        have = want;
+
+        for (p = 0; p < have; p += psi_page)
+            mem[p]++;
+
+        next += PSI_PERIOD_NS;
+        if (next < now_ns())
+            next = now_ns();
+        sleep_until_ns(next);
+    }
+}
+
+static int psi_prepare_file(void)
+{
+    struct stat sb;
+    char *buf = NULL;
+    off_t off;
+    ssize_t n;
+    int fd, ret = 0;
+
+    snprintf(io_path, sizeof(io_path), "%s/loadgen-psi", psi.dir);
+    fd = open(io_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return err_ret(io_path);
+    if (fstat(fd, &sb) < 0) {
+        ret = err_ret(io_path);
+        goto out;
+    }
+
+    if (sb.st_size < (off_t) PSI_IO_SIZE) {
+        buf = malloc(PSI_IO_CHUNK);
+        if (!buf)
+            err_exit("malloc");
+        memset(buf, 0x5a, PSI_IO_CHUNK);
+
+        for (off = sb.st_size; off < (off_t) PSI_IO_SIZE; off += n) {
+            n = pwrite(fd, buf, PSI_IO_CHUNK, off);
+            if (n == 0)
+                errno = ENOSPC;
+            if (n <= 0) {
+                ret = err_ret(io_path);
+                goto out;
+            }
+        }
+        if (fsync(fd) < 0)
+            ret = err_ret(io_path);
+    }
+out:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+/* Move a load task into the cgroup whose pressure is controlled */
+static int psi_attach(pid_t pid)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", psi.cgroup);
+    f = fopen(path, "w");
+    if (!f)
+        return err_ret(path);
+    if (fprintf(f, "%d\n", pid) < 0) {
+        fclose(f);
+        return err_ret(path);
+    }
+    if (fclose(f) == EOF)
+        return err_ret(path);
+    return 0;
+}
+
+static int psi_enabled(const struct sys_load *sys_load)
+{
+    return sys_load->psi.res != PSI_NONE;
+}
+
+static void psi_stop(void);
+
+static int psi_start(const struct sys_load *sys_load)
+{
+    void (*fn)(void *);
+    double avg10;
+    unsigned long total;
+    long i, n;
+    int ret;
+
+    psi = sys_load->psi;
+    psi_page = sysconf(_SC_PAGESIZE);
+    if (!psi.max_tasks)
+        psi.max_tasks = 4 * cpus_onln;
+    if (!psi.dir)
+        psi.dir = ".";
+    if (!psi.mem_max)
+        psi.mem_max = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+    if (psi.cgroup)
+        snprintf(psi_file, sizeof(psi_file), "%s/%s.pressure", psi.cgroup,
+                 psi_names[psi.res]);
+    else
+        snprintf(psi_file, sizeof(psi_file), "/proc/pressure/%s",
+                 psi_names[psi.res]);
+    errno = 0;
+    if (psi_read(&avg10, &total) < 0) {
+        ret = errno ? -errno : -ENOENT;
+        fprintf(stderr, "%s: cannot read %s pressure from %s\n", progname,
+                psi.full ? "full" : "some", psi_file);
+        return ret;
+    }
+
+    if (psi.res == PSI_IO) {
+        ret = psi_prepare_file();
+        if (ret < 0)
+            return ret;
+    }
+
+    ctl = shared_alloc(sizeof(struct psi_ctl));
+    switch (psi.res) {
+    case PSI_CPU:
+        fn = psi_cpu_func;
+        n = psi.max_tasks;
+        /* Nothing waits for a CPU while there are as many CPUs as tasks */
+        psi_actuate((double) cpus_onln / psi.max_tasks);
+        break;
+    case PSI_IO:
+        fn = psi_io_func;
+        n = psi.max_tasks;
+        psi_actuate(0);
+        break;
+    default:
+        fn = psi_mem_func;
+        n = cpus_onln;
+        psi_actuate(0);
+        break;
+    }
+
+    psi_nr_pids = n + 1;
+    psi_pids = calloc(psi_nr_pids, sizeof(pid_t));
+    if (!psi_pids)
+        err_exit("calloc");
+    for (i = 0; i < n; i++) {
+        psi_pids[i] = spawn_worker(fn, (void *) i, -1);
+        if (psi.cgroup && (ret = psi_attach(psi_pids[i])) < 0) {
+            psi_stop();
+            return ret;
+        }
+    }
+    psi_pids[n] = spawn_worker(psi_ctl_func, NULL, -1);
+    return 0;
+}
+
+static void psi_stop(void)
+{
+    kill_workers(psi_pids, psi_nr_pids);
+    free(psi_pids);
+    psi_pids = NULL;
+    shared_free(ctl, sizeof(struct psi_ctl));
+    ctl = NULL;
+}
+
+static void psi_report(FILE *stream, double interval)
+{
+    fprintf(stream, "psi %s %s: avg10 %.2f%% filtered %.2f%% (%.2f)",
+            psi_names[psi.res], psi.full ? "full" : "some", ctl->avg10,
+            ctl->pressure, psi.target);
+    if (psi.res == PSI_MEMORY)
+        fprintf(stream, " footprint %.0f MiB\n",
+                ctl->footprint / 1048576.0);
+    else
+        fprintf(stream, " tasks %u + %.0f%%\n", ctl->tasks,
+                ctl->busy_ns * 100.0 / PSI_PERIOD_NS);
+}
+
+const struct engine psi_engine = {
+    .name = "psi",
+    .enabled = psi_enabled,
+    .start = psi_start,
+    .stop = psi_stop,
+    .report = psi_report,
+};
@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+
+#include "loadgen.h"
+
+#define CACHELINE          64
+#define SCHED_STACK_SIZE   (64 * 1024)
+#define SCHED_START_DELAY  10000000UL    /* ns between setup and start */
+#define SCHED_FEEDBACK_NS  2000000000UL  /* least time between corrections */
+#define SCHED_GAIN         0.5           /* share of the error corrected */
+#define SCHED_MAX_STEP     1.25          /* most a correction scales by */
+#define SCHED_DEADBAND     1.0           /* utilisation error left alone */
+
+/* Per-task state; on its own line as it is written by the waker */
+struct sched_task {
+    int token;                 /* futex chain: set by the waker */
+    int pipefd[2];             /* pipe chain: the waker writes here */
+    unsigned long wake_ns;     /* when the waker woke us */
+} __attribute__((aligned(CACHELINE)));
+
+/* Per-CPU state */
+struct sched_cpu {
+    unsigned long wakeups;
+    unsigned long cpu_ns;      /* CPU time used by the tasks */
+    unsigned int created;      /* tasks the spawner has created */
+    int error;                 /* errno of a failed creation */
+    struct lat_hist lat;
+    struct sched_task tasks[];
+};
+
+/* State shared by all tasks on all CPUs */
+struct sched_shared {
+    int start;                 /* futex: set when all tasks exist */
+    unsigned long start_ns;
+    unsigned int ready;        /* tasks created so far */
+    unsigned long work_ns;     /* busy time per task per period */
+};
+
+struct sched_task_arg {
+    int cpu;
+    int ind;
+};
+
+static struct sched_stress sched;
+static struct sched_shared *shared;
+static size_t shared_size, cpu_size;
+static pid_t *spawner_pids;
+static struct lat_hist *prev_lat;
+static unsigned long prev_wakeups, prev_ctxt;
+static int *migr_fds;
+static unsigned long prev_migr;
+static struct cpu_times *prev_times;
+static unsigned long prev_cpu_ns, fb_ns, fb_cpu_ns;
+
+static const char *sched_wake_names[] = {
+    [SCHED_WAKE_TIMER] = "timer",
+    [SCHED_WAKE_FUTEX] = "futex",
+    [SCHED_WAKE_PIPE] = "pipe",
+};
+
+static struct sched_cpu *sched_cpu(int cpu)
+{
+    return (struct sched_cpu *) ((char *) shared + sizeof(struct sched_shared) +
+                                 cpu * cpu_size);
+}
+
+static long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static unsigned long thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void sched_account(struct sched_cpu *sc, unsigned long lat)
+{
+    lat_hist_add(&sc->lat, lat);
+    __atomic_fetch_add(&sc->wakeups, 1, __ATOMIC_RELAXED);
+}
+
+/* Hand the chain token over to the next task on the CPU */
+static void sched_wake_next(struct sched_task *next)
+{
+    char c = 0;
+
+    next->wake_ns = now_ns();
+    if (sched.wake == SCHED_WAKE_FUTEX) {
+        __atomic_store_n(&next->token, 1, __ATOMIC_RELEASE);
+        futex(&next->token, FUTEX_WAKE, 1);
+    }
+    else if (write(next->pipefd[1], &c, 1) < 0)
+        err_exit("write");
+}
+
+static void sched_wait_token(struct sched_task *t)
+{
+    char c;
+
+    if (sched.wake == SCHED_WAKE_FUTEX) {
+        while (!__atomic_load_n(&t->token, __ATOMIC_ACQUIRE))
+            futex(&t->token, FUTEX_WAIT, 0);
+        t->token = 0;
+    }
+    else if (read(t->pipefd[0], &c, 1) < 0)
+        err_exit("read");
+}
+
+static void sched_task_func(void *a)
+{
+    struct sched_task_arg *arg = a;
+    struct sched_cpu *sc = sched_cpu(arg->cpu);
+    struct sched_task *t = &sc->tasks[arg->ind];
+    unsigned long period = MSEC_TO_NSEC(sched.period_ms);
+    unsigned long deadline, now, used;
+    cpu_set_t set;
+    int i;
+
+    __atomic_fetch_add(&shared->ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&shared->start, __ATOMIC_ACQUIRE))
+        futex(&shared->start, FUTEX_WAIT, 0);
+
+    /* Tasks are created on their home CPU; let the scheduler move them */
+    if (!sched.pin) {
+        CPU_ZERO(&set);
+        for (i = 0; i < cpus_onln; i++)
+            CPU_SET(i, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    /* Timer tasks are spread over the period; a chain is led by task 0 */
+    deadline = shared->start_ns;
+    if (sched.wake == SCHED_WAKE_TIMER)
+        deadline += period / sched.tasks * arg->ind;
+    used = thread_cpu_ns();
+
+    while (1) {
+        if (sched.wake == SCHED_WAKE_TIMER || arg->ind == 0) {
+            sleep_until_ns(deadline);
+            now = now_ns();
+            sched_account(sc, now - deadline);
+            deadline += period;
+            if (deadline < now)
+                deadline += (now - deadline) / period * period + period;
+        }
+        else {
+            sched_wait_token(t);
+            sched_account(sc, now_ns() - t->wake_ns);
+        }
+
+        burn_ns(__atomic_load_n(&shared->work_ns, __ATOMIC_RELAXED));
+
+        if (sched.wake != SCHED_WAKE_TIMER && arg->ind + 1 < sched.tasks)
+            sched_wake_next(&sc->tasks[arg->ind + 1]);
+
+        now = thread_cpu_ns();
+        __atomic_fetch_add(&sc->cpu_ns, now - used, __ATOMIC_RELAXED);
+        used = now;
+    }
+}
+
+static void *sched_thread_func(void *a)
+{
+    sched_task_func(a);
+    return NULL;
+}
+
+/* Runs on the home CPU and creates all tasks of it. On a failure it
+ * stops there and leaves it to the parent to give up. The spawner
+ * alone is SCHED_FIFO, so that the tasks it already created don't hold
+ * up the rest; they are reset to the normal policy on creation. The
+ * reports compete with the tasks, but feedback is over measured time.
+ */
+static void sched_spawner_func(void *a)
+{
+    struct sched_param param = { .sched_priority = 1 };
+    int cpu = *(int *) a;
+    struct sched_cpu *sc = sched_cpu(cpu);
+    struct sched_task_arg *args;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct rlimit rl;
+    unsigned int i;
+    int ret;
+
+    args = calloc(sched.tasks, sizeof(struct sched_task_arg));
+    if (!args)
+        err_exit("calloc");
+
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK,
+                           &param) < 0 && cpu == 0)
+        fprintf(stderr, "%s: sched: can't make the spawners SCHED_FIFO, "
+                "setup may be slow: %s\n", progname, strerror(errno));
+
+    if (sched.wake == SCHED_WAKE_PIPE) {
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+            err_exit("getrlimit");
+        rl.rlim_cur = rl.rlim_max;
+        if (rl.rlim_cur < 2 * sched.tasks + 64) {
+            fprintf(stderr, "%s: %u pipes need a higher RLIMIT_NOFILE\n",
+                    progname, sched.tasks);
+            exit(EXIT_FAILURE);
+        }
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            err_exit("setrlimit");
+
+        for (i = 0; i < sched.tasks; i++)
+            if (pipe(sc->tasks[i].pipefd) < 0)
+                err_exit("pipe");
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SCHED_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < sched.tasks; i++) {
+        args[i].cpu = cpu;
+        args[i].ind = i;
+        if (sched.type == SCHED_TYPE_PROCESS)
+            spawn_worker(sched_task_func, &args[i], cpu);
+        else if ((ret = pthread_create(&thread, &attr, sched_thread_func,
+                                       &args[i]))) {
+            __atomic_store_n(&sc->error, ret, __ATOMIC_RELEASE);
+            break;
+        }
+        __atomic_store_n(&sc->created, i + 1, __ATOMIC_RELAXED);
+    }
+    pthread_attr_destroy(&attr);
+
+    while (1)
+        pause();
+}
+
+static unsigned long read_ctxt(void)
+{
+    char line[256];
+    unsigned long val = 0;
+    FILE *f;
+
+    f = fopen("/proc/stat", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "ctxt %lu", &val) == 1)
+            break;
+    fclose(f);
+
+    return val;
+}
+
+/* System-wide CPU migration counters; not available to everybody */
+static void sched_open_migr(void)
+{
+    struct perf_event_attr pe;
+    int i;
+
+    migr_fds = calloc(cpus_onln, sizeof(int));
+    if (!migr_fds)
+        err_exit("calloc");
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_SOFTWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_SW_CPU_MIGRATIONS;
+
+    for (i = 0; i < cpus_onln; i++) {
+        migr_fds[i] = syscall(SYS_perf_event_open, &pe, -1, i, -1, 0);
+        if (migr_fds[i] < 0) {
+            fprintf(stderr, "%s: can't count migrations: %s\n", progname,
+                    strerror(errno));
+            while (i-- > 0)
+                close(migr_fds[i]);
+            free(migr_fds);
+            migr_fds = NULL;
+            return;
+        }
+    }
+}
+
+static unsigned long sched_read_migr(void)
+{
+    unsigned long sum = 0, val;
+    int i;
+
+    for (i = 0; i < cpus_onln; i++)
+        if (read(migr_fds[i], &val, sizeof(val)) == sizeof(val))
+            sum += val;
+
+    return sum;
+}
+
+/* Fail early rather than have the spawners run into EAGAIN; the
+ * spawners themselves take a task each as well.
+ */
+static int sched_check_limits(unsigned long total)
+{
+    static const char *const limits[][2] = {
+        {"/proc/sys/kernel/pid_max", "kernel.pid_max"},
+        {"/proc/sys/kernel/threads-max", "kernel.threads-max"},
+    };
+    unsigned long max, used = 0;
+    FILE *f;
+    int i, ret = 0;
+
+    f = fopen("/proc/loadavg", "r");
+    if (f) {
+        if (fscanf(f, "%*f %*f %*f %*u/%lu", &used) != 1)
+            used = 0;
+        fclose(f);
+    }
+
+    for (i = 0; i < 2 && !ret; i++) {
+        f = fopen(limits[i][0], "r");
+        if (!f)
+            continue;
+        if (fscanf(f, "%lu", &max) == 1 && total + cpus_onln + used > max) {
+            fprintf(stderr, "%s: sched: %lu tasks don't fit in %s = %lu "
+                    "with %lu in use\n", progname, total, limits[i][1],
+                    max, used);
+            ret = -EAGAIN;
+        }
+        fclose(f);
+    }
+
+    return ret;
+}
+
+/* Wait for all tasks to reach the start barrier. A spawner that could
+ * not create all of its tasks, or died, fails the engine.
+ */
+static int sched_wait_ready(unsigned long total)
+{
+    struct sched_cpu *sc;
+    int cpu, err;
+
+    while (__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) < total) {
+        if (stop_requested)
+            return -EINTR;
+
+        for (cpu = 0; cpu < cpus_onln; cpu++) {
+            sc = sched_cpu(cpu);
+            err = __atomic_load_n(&sc->error, __ATOMIC_ACQUIRE);
+            if (!err && waitpid(spawner_pids[cpu], NULL, WNOHANG) > 0) {
+                spawner_pids[cpu] = 0;
+                err = EAGAIN;
+            }
+            if (err) {
+                fprintf(stderr, "%s: sched: only %u of %u tasks could be "
+                        "created on CPU %d: %s\n", progname,
+                        __atomic_load_n(&sc->created, __ATOMIC_RELAXED),
+                        sched.tasks, cpu, strerror(err));
+                return -err;
+            }
+        }
+        usleep(1000);
+    }
+
+    return 0;
+}
+
+static int sched_enabled(const struct sys_load *sys_load)
+{
+    return sys_load->sched.tasks > 0;
+}
+
+static void sched_stop(void);
+
+static int sched_start(const struct sys_load *sys_load)
+{
+    unsigned long t0, total;
+    int cpu, ret;
+
+    sched = sys_load->sched;
+    if (!sched.period_ms)
+        sched.period_ms = 10;
+
+    prev_times = calloc(cpus_onln, sizeof(struct cpu_times));
+    if (!prev_times)
+        err_exit("calloc");
+    read_cpu_times(prev_times, cpus_onln);
+    prev_ctxt = read_ctxt();
+    sched_open_migr();
+    if (migr_fds)
+        prev_migr = sched_read_migr();
+
+    /* Kernel threads are created by the kmod engine */
+    if (sched.type == SCHED_TYPE_KTHREAD)
+        return 0;
+
+    total = (unsigned long) sched.tasks * cpus_onln;
+    ret = sched_check_limits(total);
+    if (ret < 0) {
+        sched_stop();
+        return ret;
+    }
+
+    cpu_size = sizeof(struct sched_cpu) +
+               sched.tasks * sizeof(struct sched_task);
+    cpu_size = (cpu_size + CACHELINE - 1) & ~(CACHELINE - 1UL);
+    shared_size = sizeof(struct sched_shared) + cpus_onln * cpu_size;
+    shared = shared_alloc(shared_size);
+    shared->work_ns = MSEC_TO_NSEC(sched.period_ms) / 100 * sched.util /
+                      sched.tasks;
+
+    spawner_pids = calloc(cpus_onln, sizeof(pid_t));
+    prev_lat = calloc(cpus_onln, sizeof(struct lat_hist));
+    if (!spawner_pids || !prev_lat)
+        err_exit("calloc");
+
+    prev_cpu_ns = fb_cpu_ns = 0;
+
+    t0 = now_ns();
+    for (cpu = 0; cpu < cpus_onln; cpu++)
+        spawner_pids[cpu] = spawn_worker(sched_spawner_func, &cpu, cpu);
+
+    /* Interrupted or failed setup leaves nothing running */
+    ret = sched_wait_ready(total);
+    if (ret < 0) {
+        sched_stop();
+        return ret;
+    }
+
+    fprintf(stdout, "sched: %lu %s tasks ready in %.0f ms\n", total,
+            sched.type == SCHED_TYPE_PROCESS ? "process" : "thread",
+            (now_ns() - t0) / 1e6);
+
+    shared->start_ns = now_ns() + SCHED_START_DELAY;
+    fb_ns = shared->start_ns;
+    __atomic_store_n(&shared->start, 1, __ATOMIC_RELEASE);
+    futex(&shared->start, FUTEX_WAKE, INT_MAX);
+    return 0;
+}
+
+static void sched_stop(void)
+{
+    int i;
+
+    if (migr_fds) {
+        for (i = 0; i < cpus_onln; i++)
+            close(migr_fds[i]);
+        free(migr_fds);
+        migr_fds = NULL;
+    }
+    free(prev_times);
+    prev_times = NULL;
+
+    if (sched.type == SCHED_TYPE_KTHREAD)
+        return;
+
+    if (spawner_pids)
+        kill_workers(spawner_pids, cpus_onln);
+    free(spawner_pids);
+    spawner_pids = NULL;
+    free(prev_lat);
+    prev_lat = NULL;
+    shared_free(shared, shared_size);
+    shared = NULL;
+}
+
+/* Utilisation of all CPUs from /proc/stat, for kernel threads */
+static double sched_sys_util(void)
+{
+    struct cpu_times *cur;
+    double busy = 0, total = 0;
+    int i;
+
+    cur = calloc(cpus_onln, sizeof(struct cpu_times));
+    if (!cur)
+        err_exit("calloc");
+    read_cpu_times(cur, cpus_onln);
+
+    for (i = 0; i < cpus_onln; i++) {
+        total += cpu_times_total(&cur[i]) - cpu_times_total(&prev_times[i]);
+        busy += cur[i].user + cur[i].nice + cur[i].system + cur[i].irq +
+                cur[i].softirq - prev_times[i].user - prev_times[i].nice -
+                prev_times[i].system - prev_times[i].irq -
+                prev_times[i].softirq;
+    }
+
+    free(prev_times);
+    prev_times = cur;
+
+    return total > 0 ? busy * 100 / total : 0;
+}
+
+/* CPU time used by the tasks themselves, including the cost of
+ * switching to them but nothing else that runs on the CPUs.
+ */
+static unsigned long sched_cpu_ns(void)
+{
+    unsigned long sum = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < cpus_onln; cpu++)
+        sum += __atomic_load_n(&sched_cpu(cpu)->cpu_ns, __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+/* Scale the busy time of the tasks towards the target utilisation.
+ * Switching overhead adds to it and short sleeps are not free either.
+ * Corrections are damped and made at most every SCHED_FEEDBACK_NS,
+ * over all that time, so that they don't chase noise.
+ */
+static void sched_feedback(void)
+{
+    unsigned long now = now_ns(), cpu_ns = sched_cpu_ns(), work;
+    double util, scale;
+
+    if (now < fb_ns + SCHED_FEEDBACK_NS)
+        return;
+    util = (cpu_ns - fb_cpu_ns) * 100.0 / (now - fb_ns) / cpus_onln;
+    fb_ns = now;
+    fb_cpu_ns = cpu_ns;
+
+    if (!sched.util || fabs(util - sched.util) < SCHED_DEADBAND)
+        return;
+
+    scale = util > 0 ? 1 + (sched.util / util - 1) * SCHED_GAIN :
+            SCHED_MAX_STEP;
+    if (scale > SCHED_MAX_STEP)
+        scale = SCHED_MAX_STEP;
+    if (scale < 1 / SCHED_MAX_STEP)
+        scale = 1 / SCHED_MAX_STEP;
+
+    /* Keep at least a microsecond so that it can grow back */
+    work = shared->work_ns * scale;
+    if (work > MSEC_TO_NSEC(sched.period_ms) / sched.tasks)
+        work = MSEC_TO_NSEC(sched.period_ms) / sched.tasks;
+    if (work < 1000)
+        work = 1000;
+    __atomic_store_n(&shared->work_ns, work, __ATOMIC_RELAXED);
+}
+
+static void sched_report(FILE *stream, double interval)
+{
+    struct lat_hist *lat, *snap;
+    unsigned long wakeups = 0, ctxt, migr = 0, cpu_ns;
+    double util;
+    int cpu;
+
+    if (sched.type == SCHED_TYPE_KTHREAD)
+        util = sched_sys_util();
+    else {
+        cpu_ns = sched_cpu_ns();
+        util = (cpu_ns - prev_cpu_ns) * 100 / (interval * NSEC_PER_SEC) /
+               cpus_onln;
+        prev_cpu_ns = cpu_ns;
+    }
+    ctxt = read_ctxt();
+    if (migr_fds)
+        migr = sched_read_migr();
+
+    fprintf(stream, "sched (%u/cpu %s): util %.1f%% (%d) ctxsw %.0f/s",
+            sched.tasks, sched.type == SCHED_TYPE_KTHREAD ? "kthread" :
+            sched_wake_names[sched.wake], util, sched.util,
+            (ctxt - prev_ctxt) / interval);
+    if (migr_fds)
+        fprintf(stream, " migrations %.0f/s", (migr - prev_migr) / interval);
+    prev_ctxt = ctxt;
+    prev_migr = migr;
+
+    if (sched.type == SCHED_TYPE_KTHREAD) {
+        fprintf(stream, "\n");
+        return;
+    }
+
+    lat = calloc(1, sizeof(struct lat_hist));
+    snap = calloc(1, sizeof(struct lat_hist));
+    if (!lat || !snap)
+        err_exit("calloc");
+
+    for (cpu = 0; cpu < cpus_onln; cpu++) {
+        wakeups += __atomic_load_n(&sched_cpu(cpu)->wakeups, __ATOMIC_RELAXED);
+        lat_hist_snap(snap, &sched_cpu(cpu)->lat, &prev_lat[cpu]);
+        lat_hist_merge(lat, snap);
+    }
+
+    fprintf(stream, " wakeups %.0f/s wake latency us: p50 %.1f p99 %.1f "
+            "max %.1f\n", (wakeups - prev_wakeups) / interval,
+            lat_hist_pct(lat, 50) / 1e3, lat_hist_pct(lat, 99) / 1e3,
+            lat->max / 1e3);
+    prev_wakeups = wakeups;
+
+    sched_feedback();
+
+    free(lat);
+    free(snap);
+}
+
+const struct engine sched_engine = {
+    .name = "sched",
+    .enabled = sched_enabled,
+    .start = sched_start,
+    .stop = sched_stop,
+    .report = sched_report,
+};
@@ -0,0 +1,21 @@
+/* Shared by the unit tests of loadgen: CHECK() prints what failed and
+ * marks the run as failed, the test goes on with the next check.
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int failed;
+
+#define CHECK(cond, ...)					\
+	do {							\
+		if (!(cond)) {					\
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__);			\
+			printf("\n");				\
+			failed = 1;				\
+		}						\
+	} while (0)
+
+#endif
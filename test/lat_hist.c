@@ -0,0 +1,116 @@
+/* Bucketing and percentiles of struct lat_hist */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "loadgen.h"
+#include "check.h"
+
+char *progname = "lat_hist";
+
+static struct lat_hist h, prev, out;
+
+/* Lower bound of the bucket of ns, as lat_hist_pct() reports it */
+static unsigned long floor_of(unsigned long ns)
+{
+	struct lat_hist one;
+
+	memset(&one, 0, sizeof(one));
+	lat_hist_add(&one, ns);
+	return lat_hist_pct(&one, 50);
+}
+
+static void test_buckets(void)
+{
+	unsigned long v, f, prev_f = 0;
+
+	/* Exact below 16, then 8 buckets per power of two: 12.5% wide */
+	for (v = 0; v < 16; v++)
+		CHECK(floor_of(v) == v, "floor(%lu) = %lu", v, floor_of(v));
+	for (v = 16; v < 1UL << 20; v += v / 64 + 1) {
+		f = floor_of(v);
+		CHECK(f <= v && v - f < f / 8 + 1 && f >= prev_f,
+		      "floor(%lu) = %lu", v, f);
+		prev_f = f;
+	}
+	CHECK(floor_of(1000) == 960, "floor(1000) = %lu", floor_of(1000));
+	CHECK(floor_of(1024) == 1024, "floor(1024) = %lu", floor_of(1024));
+	v = ~0UL;
+	f = floor_of(v);
+	CHECK(f <= v && f >= v - v / 8, "floor(ULONG_MAX) = %lu", f);
+}
+
+static void test_pct(void)
+{
+	unsigned long v;
+
+	memset(&h, 0, sizeof(h));
+	CHECK(lat_hist_pct(&h, 50) == 0, "empty p50 = %lu",
+	      lat_hist_pct(&h, 50));
+
+	/* 1..100: the p-th percentile is the bucket of value p + 1 */
+	for (v = 1; v <= 100; v++)
+		lat_hist_add(&h, v);
+	CHECK(h.n == 100 && h.sum == 5050 && h.max == 100,
+	      "n %lu sum %lu max %lu", h.n, h.sum, h.max);
+	CHECK(lat_hist_pct(&h, 0) == 1, "p0 = %lu", lat_hist_pct(&h, 0));
+	CHECK(lat_hist_pct(&h, 10) == 11, "p10 = %lu", lat_hist_pct(&h, 10));
+	CHECK(lat_hist_pct(&h, 50) == floor_of(51), "p50 = %lu",
+	      lat_hist_pct(&h, 50));
+	CHECK(lat_hist_pct(&h, 99) == floor_of(100), "p99 = %lu",
+	      lat_hist_pct(&h, 99));
+	CHECK(lat_hist_pct(&h, 100) == floor_of(100), "p100 = %lu",
+	      lat_hist_pct(&h, 100));
+
+	/* One outlier in a thousand shows at p99.9 only */
+	memset(&h, 0, sizeof(h));
+	for (v = 0; v < 999; v++)
+		lat_hist_add(&h, 100);
+	lat_hist_add(&h, 1000000);
+	CHECK(lat_hist_pct(&h, 99) == floor_of(100), "p99 = %lu",
+	      lat_hist_pct(&h, 99));
+	CHECK(lat_hist_pct(&h, 99.95) == floor_of(1000000), "p99.95 = %lu",
+	      lat_hist_pct(&h, 99.95));
+}
+
+static void test_snap_merge(void)
+{
+	struct lat_hist sum;
+
+	memset(&h, 0, sizeof(h));
+	memset(&prev, 0, sizeof(prev));
+	memset(&sum, 0, sizeof(sum));
+
+	lat_hist_add(&h, 10);
+	lat_hist_add(&h, 2000);
+	lat_hist_snap(&out, &h, &prev);
+	CHECK(out.n == 2 && out.sum == 2010 && out.max == 2000,
+	      "first snap n %lu sum %lu max %lu", out.n, out.sum, out.max);
+	lat_hist_merge(&sum, &out);
+
+	/* Only what came after the first snapshot, and a fresh maximum */
+	lat_hist_add(&h, 30);
+	lat_hist_snap(&out, &h, &prev);
+	CHECK(out.n == 1 && out.sum == 30 && out.max == 30,
+	      "second snap n %lu sum %lu max %lu", out.n, out.sum, out.max);
+	CHECK(lat_hist_pct(&out, 50) == 30, "second snap p50 = %lu",
+	      lat_hist_pct(&out, 50));
+	lat_hist_merge(&sum, &out);
+
+	CHECK(sum.n == 3 && sum.sum == 2040 && sum.max == 2000,
+	      "merged n %lu sum %lu max %lu", sum.n, sum.sum, sum.max);
+	CHECK(lat_hist_pct(&sum, 50) == 30, "merged p50 = %lu",
+	      lat_hist_pct(&sum, 50));
+}
+
+int main()
+{
+	test_buckets();
+	test_pct();
+	test_snap_merge();
+
+	if (failed)
+		return 1;
+	printf("lat_hist: ok\n");
+	return 0;
+}
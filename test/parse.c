@@ -0,0 +1,77 @@
+/* Percentage and size arguments */
+
+#include <stdio.h>
+#include <errno.h>
+
+#include "loadgen.h"
+#include "check.h"
+
+char *progname = "parse";
+
+static const struct {
+	const char *s;
+	int ret;
+	int pct;
+} pcts[] = {
+	{"0", 0, 0},
+	{"42", 0, 42},
+	{"100", 0, 100},
+	{"101", -EINVAL, 0},
+	{"-1", -EINVAL, 0},
+	{"", -EINVAL, 0},
+	{"5%", -EINVAL, 0},
+	{"abc", -EINVAL, 0},
+	{"4294967346", -EINVAL, 0},
+	{"99999999999999999999", -EINVAL, 0},
+};
+
+static const struct {
+	const char *s;
+	int ret;
+	unsigned long size;
+} sizes[] = {
+	{"1", 0, 1},
+	{"4096", 0, 4096},
+	{"4k", 0, 4096},
+	{"4K", 0, 4096},
+	{"16M", 0, 16UL << 20},
+	{"2g", 0, 2UL << 30},
+	{"17179869183G", 0, 17179869183UL << 30},
+	{"17179869184G", -ERANGE, 0},
+	{"18014398509481984K", -ERANGE, 0},
+	{"99999999999999999999", -ERANGE, 0},
+	{"0", -EINVAL, 0},
+	{"0K", -EINVAL, 0},
+	{"", -EINVAL, 0},
+	{"K", -EINVAL, 0},
+	{"-4K", -EINVAL, 0},
+	{"4KB", -EINVAL, 0},
+	{"4T", -EINVAL, 0},
+	{"1.5M", -EINVAL, 0},
+};
+
+int main()
+{
+	unsigned long size;
+	unsigned int i;
+	int pct, ret;
+
+	for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+		pct = -1;
+		ret = parse_pct(pcts[i].s, &pct);
+		CHECK(ret == pcts[i].ret && (ret || pct == pcts[i].pct),
+		      "parse_pct(\"%s\") = %d, %d", pcts[i].s, ret, pct);
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size = 0;
+		ret = parse_size(sizes[i].s, &size);
+		CHECK(ret == sizes[i].ret && (ret || size == sizes[i].size),
+		      "parse_size(\"%s\") = %d, %lu", sizes[i].s, ret, size);
+	}
+
+	if (failed)
+		return 1;
+	printf("parse: ok\n");
+	return 0;
+}
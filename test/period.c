@@ -0,0 +1,46 @@
+/* Load period alignment of period_start_ns() */
+
+#include <stdio.h>
+
+#include "loadgen.h"
+#include "check.h"
+
+char *progname = "period";
+
+#define SEC	1000000000UL
+
+int main()
+{
+	unsigned long t, s, before;
+	int i, num;
+
+	/* An epoch ahead: the first period starts there */
+	period_epoch_ns = now_ns() + 5 * SEC;
+	for (num = 1; num <= 4; num++)
+		for (i = 0; i < num; i++) {
+			s = period_start_ns(i, num);
+			CHECK(s == period_epoch_ns + SEC / num * i,
+			      "future epoch, worker %d/%d: %+ld ns", i, num,
+			      (long) (s - period_epoch_ns));
+		}
+
+	/* An epoch behind: the next whole second counted from it */
+	for (t = 0; t < 3 * SEC; t += SEC / 3) {
+		period_epoch_ns = now_ns() - 10 * SEC - t;
+		for (i = 0; i < 4; i++) {
+			before = now_ns();
+			s = period_start_ns(i, 4) - SEC / 4 * i;
+			CHECK((s - period_epoch_ns) % SEC == 0,
+			      "worker %d: %lu ns off the second", i,
+			      (s - period_epoch_ns) % SEC);
+			CHECK(s > before && s <= now_ns() + SEC,
+			      "worker %d: start %+ld ns from now", i,
+			      (long) (s - before));
+		}
+	}
+
+	if (failed)
+		return 1;
+	printf("period: ok\n");
+	return 0;
+}
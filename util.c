@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "loadgen.h"
+
+/* Like err_exit, for errors the caller hands back: says what failed
+ * and returns the negative errno.
+ */
+int err_ret(const char *msg)
+{
+    int err = errno;
+
+    fprintf(stderr, "%s: %s: %s\n", progname, msg, strerror(err));
+    return -err;
+}
+
+/* Percentage in [0-100]; returns 0 or -EINVAL */
+int parse_pct(const char *s, int *pct)
+{
+    char *endptr;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &endptr, 10);
+    if (endptr == s || endptr[0] != '\0' || errno || v < 0 || v > 100)
+        return -EINVAL;
+    *pct = v;
+    return 0;
+}
+
+/* Non-zero size in bytes with an optional K, M or G suffix; returns 0,
+ * -EINVAL or -ERANGE if it doesn't fit.
+ */
+int parse_size(const char *s, unsigned long *size)
+{
+    unsigned long v;
+    char *endptr;
+    int shift = 0;
+
+    errno = 0;
+    v = strtoul(s, &endptr, 10);
+    if (endptr == s || s[0] == '-')
+        return -EINVAL;
+    if (errno)
+        return -errno;
+    switch (endptr[0]) {
+    case 'G': case 'g':
+        shift += 10;
+        /* fall through */
+    case 'M': case 'm':
+        shift += 10;
+        /* fall through */
+    case 'K': case 'k':
+        shift += 10;
+        endptr++;
+    }
+    if (endptr[0] != '\0' || !v)
+        return -EINVAL;
+    if (v > ULONG_MAX >> shift)
+        return -ERANGE;
+    *size = v << shift;
+    return 0;
+}
+
+unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void sleep_until_ns(unsigned long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000UL;
+    ts.tv_nsec = ns % 1000000000UL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+void burn_ns(unsigned long ns)
+{
+    unsigned long end = now_ns() + ns;
+
+    while (now_ns() < end)
+        ;
+}
+
+/* Load periods are whole seconds counted from here; agents set it to
+ * the start time agreed with their controller.
+ */
+unsigned long period_epoch_ns;
+
+/* Start of the first 1 second load period of worker ind out of num:
+ * the next full second since period_epoch_ns plus an even share of it.
+ */
+unsigned long period_start_ns(int ind, int num)
+{
+    unsigned long t = now_ns();
+
+    if (t < period_epoch_ns)
+        t = period_epoch_ns;
+    else
+        t = period_epoch_ns + ((t - period_epoch_ns) / 1000000000UL + 1) *
+            1000000000UL;
+    return t + (1000000000UL / num) * ind;
+}
+
+/* Fork a worker running fn(arg), bound to cpu unless cpu < 0.
+ * The worker never returns to the caller's code path.
+ */
+pid_t spawn_worker(void (*fn)(void *), void *arg, int cpu)
+{
+    pid_t parent = getpid();
+    sigset_t mask, old;
+    cpu_set_t set;
+    pid_t pid;
+
+    /* A SIGTERM from kill_workers() must not reach the parent's
+     * handler in the child, which would then never stop.
+     */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+
+    pid = fork();
+    if (pid < 0)
+        err_exit("fork");
+    if (pid) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return pid;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    /* Make sure children are dead after parent's death, also if it
+     * died before the signal was set up.
+     */
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+        err_exit("prctl");
+    if (getppid() != parent)
+        _exit(EXIT_SUCCESS);
+
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            err_exit("sched_setaffinity");
+    }
+
+    fn(arg);
+    _exit(EXIT_SUCCESS);
+}
+
+void kill_workers(pid_t *pids, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    for (i = 0; i < n; i++)
+        if (pids[i] > 0) {
+            waitpid(pids[i], NULL, 0);
+            pids[i] = 0;
+        }
+}
+
+/* Anonymous memory shared between the parent and forked workers */
+void *shared_alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        err_exit("mmap");
+    return p;
+}
+
+void shared_free(void *p, size_t size)
+{
+    if (p)
+        munmap(p, size);
+}
+
+static int lat_bucket(unsigned long ns)
+{
+    int msb;
+
+    if (ns < 16)
+        return ns;
+    msb = 63 - __builtin_clzl(ns);
+    return 16 + (msb - 4) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+static unsigned long lat_bucket_floor(int idx)
+{
+    int msb;
+
+    if (idx < 16)
+        return idx;
+    msb = (idx - 16) / 8 + 4;
+    return (8UL | ((idx - 16) % 8)) << (msb - 3);
+}
+
+/* Histograms may be shared by workers running on the same CPU, so
+ * the update is done with relaxed atomics.
+ */
+void lat_hist_add(struct lat_hist *h, unsigned long ns)
+{
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->count[lat_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Store into out what has been recorded in live since the previous
+ * snapshot. The maximum is reset on every snapshot.
+ */
+void lat_hist_snap(struct lat_hist *out, struct lat_hist *live,
+                   struct lat_hist *prev)
+{
+    int i;
+    unsigned long v;
+
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        v = __atomic_load_n(&live->count[i], __ATOMIC_RELAXED);
+        out->count[i] = v - prev->count[i];
+        prev->count[i] = v;
+    }
+    v = __atomic_load_n(&live->n, __ATOMIC_RELAXED);
+    out->n = v - prev->n;
+    prev->n = v;
+    v = __atomic_load_n(&live->sum, __ATOMIC_RELAXED);
+    out->sum = v - prev->sum;
+    prev->sum = v;
+    out->max = __atomic_exchange_n(&live->max, 0, __ATOMIC_RELAXED);
+}
+
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+    int i;
+
+    for (i = 0; i < LAT_HIST_BUCKETS; i++)
+        dst->count[i] += src->count[i];
+    dst->n += src->n;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* Lower bound of the bucket holding the pct-th percentile */
+unsigned long lat_hist_pct(const struct lat_hist *h, double pct)
+{
+    unsigned long want, seen = 0;
+    int i;
+
+    if (!h->n)
+        return 0;
+    want = h->n * pct / 100.0;
+    if (want >= h->n)
+        want = h->n - 1;
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen > want)
+            return lat_bucket_floor(i);
+    }
+    return h->max;
+}
+
+/* Fill times[] for CPUs 0..ncpus-1; returns the number of CPUs read */
+int read_cpu_times(struct cpu_times *times, int ncpus)
+{
+    struct cpu_times t;
+    char line[256];
+    FILE *f;
+    int cpu, n = 0;
+
+    memset(times, 0, sizeof(struct cpu_times) * ncpus);
+    f = fopen("/proc/stat", "r");
+    if (!f)
+        return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        memset(&t, 0, sizeof(t));
+        if (sscanf(line, "cpu%d %lu %lu %lu %lu %lu %lu %lu %lu", &cpu,
+                   &t.user, &t.nice, &t.system, &t.idle, &t.iowait,
+                   &t.irq, &t.softirq, &t.steal) < 5)
+            continue;
+        if (cpu < 0 || cpu >= ncpus)
+            continue;
+        times[cpu] = t;
+        n++;
+    }
+    fclose(f);
+
+    return n;
+}
+
+unsigned long cpu_times_total(const struct cpu_times *t)
+{
+    return t->user + t->nice + t->system + t->idle + t->iowait +
+           t->irq + t->softirq + t->steal;
+}